@@ -1,6 +1,7 @@
 /** @file cups-epilog.c - Epilog cups driver */
 #define _POSIX_SOURCE
-#define _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
 
 /* @file cups-epilog.c @verbatim
  *========================================================================
@@ -112,24 +113,44 @@
  * includes
  */
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <math.h>
 #include <limits.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/signal.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <pwd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#ifdef HAVE_LIBGS
+#include <ghostscript/iapi.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "laser-time.h"
 
 
 /*************************************************************************
@@ -139,6 +160,15 @@
 /** Default on whether or not auto-focus is enabled. */
 #define AUTO_FOCUS (1)
 
+/** Version of the compiled job cache; bump it when the output changes. */
+#define CACHE_VERSION "epilog-cache 1"
+
+/** Version of the tours saved for the next revision of a job. */
+#define VECTOR_TOUR_VERSION "epilog-tour 1"
+
+/** Default bound on the size of the compiled job cache (in MB). */
+#define CACHE_SIZE_DEFAULT (1024)
+
 /** Default bed height (y-axis) in pts. */
 #define BED_HEIGHT (864)
 
@@ -162,6 +192,20 @@
  */
 #define FLIP (0)
 
+/** Maximum number of arguments to a ghostscript run. */
+#define GS_ARGS_MAX (32)
+
+/** Space for the text of the arguments to a ghostscript run. */
+#define GS_ARGS_NBYTES (4096)
+
+/** gsapi return code when the interpreter quits normally. */
+#define GS_ERROR_QUIT (-101)
+
+/** The first gs, as major * 100 + minor, without the postscript based pdf
+ * interpreter that -dNEWPDF=false selects.
+ */
+#define GS_NO_PS_PDF (1003)
+
 /** Maximum allowable hostname characters. */
 #define HOSTNAME_NCHARS (1024)
 
@@ -171,6 +215,15 @@
 /** Additional offset for the Y axis. */
 #define HPGLY (0)
 
+/** A job with somewhere to go is flushed when it grows past this. */
+#define PJL_FLUSH_NBYTES (64 << 10)
+
+/** Number of jobs the spooler compiles at once. */
+#define SPOOL_WORKERS (2)
+
+/** Seconds that a laser in a list is passed over after a failed send. */
+#define SPOOL_RETRY_TIME (60)
+
 /** Whether or not to rotate the incoming PDF 90 degrees clockwise. */
 #define PDF_ROTATE_90 (1)
 
@@ -180,6 +233,19 @@
 /** Maximum wait before timing out on connecting to the printer (in seconds). */
 #define PRINTER_MAX_WAIT (300)
 
+/** How long each round of connects to the printer's addresses may take. */
+#define PRINTER_CONNECT_MS (2000)
+
+/** First and largest delay between rounds of connects (in ms). */
+#define PRINTER_BACKOFF_MS (250)
+#define PRINTER_BACKOFF_MAX_MS (8000)
+
+/** Socket send buffer for the job data. */
+#define PRINTER_SNDBUF_NBYTES (1 << 20)
+
+/** A send that blocks longer than this is counted as a stall (in seconds). */
+#define PRINTER_STALL_TIME (0.1)
+
 /** Default mode for processing raster engraving (varying power depending upon
  * image characteristics).
  * Possible values are:
@@ -193,6 +259,36 @@
 /** Default power level for raster engraving */
 #define RASTER_POWER_DEFAULT (40)
 
+/** Number of bitmap rows handed to the raster worker pool at a time. */
+#define RASTER_BAND_ROWS (256)
+
+/** Width in output bytes of the tiles used to find raster islands. */
+#define RASTER_ISLAND_TILE (8)
+
+/** Narrowest gap (in pts) between raster islands that is worth splitting. */
+#define RASTER_ISLAND_GAP (POINTS_PER_INCH / 2)
+
+/** Raster compression modes that can be selected per row. */
+#define RASTER_COMPRESS_RAW (0)
+#define RASTER_COMPRESS_MODES (8)
+
+/** Number of cells an error diffusion row works on between waits for the
+ * row before it.
+ */
+#define HALFTONE_CHUNK (64)
+
+/** Rows in the error diffusion ring; must exceed RASTER_BAND_ROWS + 2. */
+#define HALFTONE_ERR_ROWS (RASTER_BAND_ROWS + 4)
+
+/** Maximum number of points in a material response curve. */
+#define CURVE_MAX_POINTS (32)
+
+/** Edge in pixels of the tiles the raster rotation works on. */
+#define ROTATE_BLOCK (64)
+
+/** Head turnaround cost (in pts of travel) used to pick the scan axis. */
+#define RASTER_TURNAROUND (POINTS_PER_INCH / 4)
+
 /** Whether or not the raster printing is to be repeated. */
 #define RASTER_REPEAT (1)
 
@@ -256,6 +352,11 @@ static const char *job_user = NULL;
 /** Title for the job print. */
 static const char *job_title = NULL;
 
+/** Full path of the input file, or "stdin", to tell the tours of jobs
+ * with the same title apart.
+ */
+static const char *job_input = NULL;
+
 /** Variable to track the resolution of the print. */
 static int resolution = RESOLUTION_DEFAULT;
 
@@ -273,6 +374,106 @@ static int raster_power = RASTER_POWER_DEFAULT;
 /** Variable to track whether or not a rasterization should be repeated. */
 static int raster_repeat = RASTER_REPEAT;
 
+/** Should the raster be split into separately engraved islands? */
+static int raster_island_mode = 0;
+
+/** Built-in halftoning for mono mode. One of none 0, ordered dither 'o',
+ * Floyd-Steinberg 'f' or Jarvis 'j'.  Without it, ghostscript renders
+ * the screen set up by ps_to_eps().
+ */
+static char halftone_mode = 0;
+
+/** Size in pixels of each halftone dot. */
+static int halftone_dot = 1;
+
+/** Rotate mono and grey rasters: 0 never, 90 always, -1 if faster. */
+static int raster_rotate = 0;
+
+/** Bitmap height before rotation, or 0 if the job was not rotated. */
+static int raster_rotated_height = 0;
+
+/** Read the raster from a gs pipe rather than a temporary bitmap. */
+static int raster_stream = 0;
+
+/** Run pdf input directly in gs after the prologue instead of pdf2ps. */
+static int pdf_direct = 0;
+
+/** The pdf file that gs runs after the prologue, or NULL for postscript. */
+static const char * pdf_input = NULL;
+
+/** Number of gs rendering threads, 1 for none or 0 for one per cpu. */
+static int raster_bands = 1;
+
+/** Render only the bounding box of the raster marks. */
+static int raster_crop = 0;
+
+/** Position of the cropped raster window on the page, in pixels. */
+static int raster_crop_x = 0;
+static int raster_crop_y = 0;
+
+/** Size of the cropped raster window in pixels, 0 for the whole page. */
+static int raster_window_width = 0;
+static int raster_window_height = 0;
+
+/** PageOffset that moves the raster marks into the window, in pts. */
+static int raster_window_offset_x = 0;
+static int raster_window_offset_y = 0;
+
+/** Send the job while it is generated: 0 off, or the number of bytes to
+ * declare to the printer.
+ */
+static long lpd_stream_size = 0;
+
+/** Spooler mode: 0 none, 'Q' to serve, 'q' to submit or 'Z' for status. */
+static int spool_mode = 0;
+
+/** The unix socket of the spooler. */
+static const char * spool_socket = NULL;
+
+/** Number of jobs the spooler compiles at once. */
+static int spool_workers = SPOOL_WORKERS;
+
+/** In a job compiled by the spooler, where its pages go. */
+static int spool_out_fd = -1;
+
+/** Directory of the compiled job cache, or NULL for none. */
+static const char * cache_dir = NULL;
+
+/** Size the cache is trimmed to, least recently used first (in bytes). */
+static long cache_size_max = (long) CACHE_SIZE_DEFAULT << 20;
+
+/** Material response curve for grey and colour power levels. */
+static double curve_gamma = 1.0;
+static int curve_points;
+static struct
+{
+	double in;
+	double out;
+} curve_point[CURVE_MAX_POINTS];
+
+/** Grey level to raster power table, built by raster_lut_build(). */
+static uint8_t raster_lut[256];
+
+/** Should each raster row use the smallest of several compression modes? */
+static int raster_compress_auto = 0;
+
+/** Rows and bytes sent in each raster compression mode. */
+static struct
+{
+	long rows[RASTER_COMPRESS_MODES];
+	long bytes[RASTER_COMPRESS_MODES];
+} raster_stats;
+
+/** Estimated machine time of the raster and vector parts of this page. */
+static double page_time_raster;
+static double page_time_vector;
+
+/** Pages of the job whose vectors have been generated, for the tours. */
+static int vector_pages;
+
+/** Number of raster encoding threads (0 = one per online processor). */
+static int raster_threads = 0;
+
 /** FIXME -- pixel size of screen, 0= threshold */
 static int screen_size = SCREEN_DEFAULT;
 
@@ -310,18 +511,37 @@ static int y_repeat = 1;
 static int do_vector_optimize = 1;
 
 
+/** A print job built in memory.  With a sink it is written out in
+ * large blocks as it grows, and copied to the tee if there is one;
+ * otherwise it is kept whole to be sent.
+ */
+typedef struct
+{
+	uint8_t * data;
+	size_t len;
+	size_t size;
+	FILE * sink;
+	FILE * tee;
+	bool failed;
+} pjl_buf_t;
+
+
 /*************************************************************************
  * local functions
  */
 static int big_to_little_endian(uint8_t *position, int bytes);
-static bool generate_raster(FILE *pjl_file, FILE *bitmap_file);
-static bool generate_vector(FILE *pjl_file, FILE *vector_file);
-static bool generate_pjl(FILE *bitmap_file, FILE *pjl_file, FILE *vector_file);
+static bool generate_raster(pjl_buf_t *job, FILE *bitmap_file);
+static bool generate_vector(pjl_buf_t *job, FILE *vector_file);
+static bool generate_pjl(FILE *bitmap_file, pjl_buf_t *job, const char *filename_vector, FILE *page_vector_file);
 static bool ps_to_eps(FILE *ps_file, FILE *eps_file);
 static void range_checks(void);
 static int printer_connect(const char *host, const int timeout);
 static bool printer_disconnect(int socket_descriptor);
-static bool printer_send(const char *host, FILE *pjl_file);
+static bool printer_send(const char *host, const pjl_buf_t *job, const char *name, const char *user);
+static bool spool_args_allowed(int argc, char * const argv[]);
+static int epilog_main(int argc, char *argv[]);
+static void tmp_file_create(char *filename, const char *file_basename, const char *suffix);
+static void tmp_file_remove(const char *filename, const char *file_basename, const char *suffix);
 
 
 /*************************************************************************/
@@ -349,386 +569,3027 @@ big_to_little_endian(uint8_t *position, int nbytes)
     return result;
 }
 
-/**
- * Execute ghostscript feeding it an ecapsulated postscript file which is then
- * converted into a bitmap image. As a byproduct output of the ghostscript
- * process is redirected to a .vector file which will contain instructions on
- * how to perform a vector cut of lines within the postscript.
- *
- * @param filename_bitmap the filename to use for the resulting bitmap file.
- * @param filename_eps the filename to read in encapsulated postscript from.
- * @param filename_vector the filename that will contain the vector
- * information.
- * @param bmp_mode a string which is one of bmp16m, bmpgray, or bmpmono.
- * @param resolution the encapsulated postscript resolution.
- *
- * @return Return true if the execution of ghostscript succeeds, false
- * otherwise.
+/** Arguments for one ghostscript run, built up one at a time so that
+ * they can be handed to the library or quoted for the shell.
  */
-static bool
-execute_ghostscript(
-	const char * const filename_bitmap,
-	const char * const filename_eps,
-	const char * const filename_vector,
-	const char * const bmp_mode,
-	int resolution
+typedef struct
+{
+	int argc;
+	char * argv[GS_ARGS_MAX + 1];
+	size_t used;
+	char text[GS_ARGS_NBYTES];
+} gs_args_t;
+
+
+/** Append one formatted argument to a ghostscript run. */
+static void
+gs_arg(
+	gs_args_t * const args,
+	const char * const fmt,
+	...
 )
 {
-	char buf[8192];
-	snprintf(buf, sizeof(buf),
-		"gs"
-			" -q"
-			" -dBATCH"
-			" -dNOPAUSE"
-			" -r%d"
-			" -sDEVICE=%s"
-			" -sOutputFile=%s"
-			" %s"
-			" > %s"
-			"",
-		resolution,
-		bmp_mode,
-		filename_bitmap,
-		filename_eps,
-		filename_vector
-	);
+	const size_t space = sizeof(args->text) - args->used;
+	if (args->argc >= GS_ARGS_MAX || space == 0)
+		return;
 
-	if (debug)
-		printf("Executing: %s\n", buf);
+	va_list ap;
+	va_start(ap, fmt);
+	const int len = vsnprintf(args->text + args->used, space, fmt, ap);
+	va_end(ap);
+	if (len < 0 || (size_t) len >= space)
+		return;
 
-	if (system(buf))
-		return false;
+	args->argv[args->argc++] = args->text + args->used;
+	args->argv[args->argc] = NULL;
+	args->used += len + 1;
+}
 
-	return true;
+
+/** Start a ghostscript run with the options every run shares. */
+static void
+gs_args_init(
+	gs_args_t * const args,
+	int resolution
+)
+{
+	args->argc = 0;
+	args->used = 0;
+	args->argv[0] = NULL;
+
+	gs_arg(args, "gs");
+	gs_arg(args, "-q");
+	gs_arg(args, "-dBATCH");
+	gs_arg(args, "-dNOPAUSE");
+	gs_arg(args, "-r%d", resolution);
 }
 
 
 /**
- *
+ * Add the gs arguments to render the raster in bands on several threads.
+ * The bands are the same height as the encoder's, and gs still writes
+ * the rows in order, so a streamed raster is encoded as they finish.
  */
-static bool
-generate_raster(FILE *pjl_file, FILE *bitmap_file)
+static void
+gs_args_bands(
+	gs_args_t * const args
+)
 {
-    const int invert = 0;
-    int h;
-    int d;
-    int offx;
-    int offy;
-    int basex = 0;
-    int basey = 0;
-    int repeat;
+	if (raster_bands == 1)
+		return;
 
-    uint8_t bitmap_header[BITMAP_HEADER_NBYTES];
+	const int threads = raster_bands > 0
+		? raster_bands
+		: sysconf(_SC_NPROCESSORS_ONLN);
 
-    if (x_center) {
-        basex = x_center - width / 2;
-    }
-    if (y_center) {
-        basey = y_center - height / 2;
-    }
-    if (basex < 0) {
-        basex = 0;
-    }
-    if (basey < 0) {
-        basey = 0;
-    }
-    // rasterises
-    basex = basex * resolution / POINTS_PER_INCH;
-    basey = basey * resolution / POINTS_PER_INCH;
+	gs_arg(args, "-dNumRenderingThreads=%d", threads);
+	gs_arg(args, "-dMaxBitmap=0");
+	gs_arg(args, "-dBandHeight=%d", RASTER_BAND_ROWS);
+}
 
-    repeat = raster_repeat;
-    while (repeat--) {
-        /* repeated (over printed) */
-        int pass;
-        int passes;
-        long base_offset;
-        if (raster_mode == 'c') {
-            passes = 7;
-        } else {
-            passes = 1;
-        }
 
-        /* Read in the bitmap header. */
-        fread(bitmap_header, 1, BITMAP_HEADER_NBYTES, bitmap_file);
+/** Add the gs arguments that select the cropped raster window. */
+static void
+gs_args_window(
+	gs_args_t * const args
+)
+{
+	if (!raster_window_width)
+		return;
 
-        /* Re-load width/height from bmp as it is possible that someone used
-         * setpagedevice or some such
-         */
-        /* Bytes 18 - 21 are the bitmap width (little endian format). */
-        width = big_to_little_endian(bitmap_header + 18, 4);
+	gs_arg(args, "-g%dx%d", raster_window_width, raster_window_height);
+	gs_arg(args, "-dFIXEDMEDIA");
+	gs_arg(args, "-c");
+	gs_arg(args, "<</PageOffset [%d %d]>> setpagedevice",
+		raster_window_offset_x,
+		raster_window_offset_y
+	);
+	gs_arg(args, "-f");
+}
 
-        /* Bytes 22 - 25 are the bitmap height (little endian format). */
-        height = big_to_little_endian(bitmap_header + 22, 4);
 
-        /* Bytes 10 - 13 base offset for the beginning of the bitmap data. */
-        base_offset = big_to_little_endian(bitmap_header + 10, 4);
+/**
+ * Add the files for gs to run.  A pdf is run after the prologue with the
+ * postscript based pdf interpreter, which uses the redefined operators.
+ */
+static void
+gs_args_input(
+	gs_args_t * const args,
+	const char * const filename_eps
+)
+{
+	if (pdf_input)
+		gs_arg(args, "-dNEWPDF=false");
 
+	gs_arg(args, "%s", filename_eps);
 
-        if (raster_mode == 'c' || raster_mode == 'g') {
-            /* colour/grey are byte per pixel power levels */
-            h = width;
-            /* BMP padded to 4 bytes per scan line */
-            d = (h * 3 + 3) / 4 * 4;
-        } else {
-            /* mono */
-            h = (width + 7) / 8;
-            /* BMP padded to 4 bytes per scan line */
-            d = (h + 3) / 4 * 4;
-        }
-        if (debug) {
-            printf("Width %d Height %d Bytes %d Line %d\n",
-                    width, height, h, d);
-        }
+	if (pdf_input)
+		gs_arg(args, "%s", pdf_input);
+}
 
-        /* Raster Orientation */
-        fprintf(pjl_file, "\e*r0F");
-        /* Raster power -- color and gray scaled before, but scale with the user provided power */
-        fprintf(pjl_file, "\e&y%dP", raster_power);
 
-        /* Raster speed */
-        fprintf(pjl_file, "\e&z%dS", raster_speed);
-        fprintf(pjl_file, "\e*r%dT", height * y_repeat);
-        fprintf(pjl_file, "\e*r%dS", width * x_repeat);
-        /* Raster compression */
-        fprintf(pjl_file, "\e*b%dM", (raster_mode == 'c' || raster_mode == 'g')
-                ? 7 : 2);
-        /* Raster direction (1 = up) */
-        fprintf(pjl_file, "\e&y1O");
+/**
+ * Join the arguments into a command line, quoting any that need it.  A
+ * quote inside an argument is closed, escaped and reopened, so that a
+ * file name can't end the quoting early.
+ *
+ * @return Return false if the command line does not fit in buf.
+ */
+static bool
+gs_args_command(
+	const gs_args_t * const args,
+	char * const buf,
+	const size_t size
+)
+{
+	size_t len = 0;
 
-        if (debug) {
-            /* Output raster debug information */
-            printf("Raster power=%d speed=%d\n",
-                    ((raster_mode == 'c' || raster_mode == 'g') ?
-                     100 : raster_power),
-                    raster_speed);
-        }
+	for (int i = 0 ; i < args->argc ; i++)
+	{
+		const char * const arg = args->argv[i];
+		const int quote = arg[strspn(arg,
+			"abcdefghijklmnopqrstuvwxyz"
+			"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+			"0123456789_-+=.,:/%")] != '\0';
+
+		// Room for the escaped quotes, the separator and the nul
+		size_t need = strlen(arg) + 2;
+		for (const char * c = arg ; quote && *c ; c++)
+			need += *c == '\'' ? 4 : 0;
+		if (quote)
+			need += 2;
+		if (len + need > size)
+		{
+			buf[len] = '\0';
+			return false;
+		}
 
-        /* start at current position */
-        fprintf(pjl_file, "\e*r1A");
-        for (offx = width * (x_repeat - 1); offx >= 0; offx -= width) {
-            for (offy = height * (y_repeat - 1); offy >= 0; offy -= height) {
-                for (pass = 0; pass < passes; pass++) {
-                    // raster (basic)
-                    int y;
-                    char dir = 0;
-
-                    fseek(bitmap_file, base_offset, SEEK_SET);
-                    for (y = height - 1; y >= 0; y--) {
-                        int l;
-
-                        switch (raster_mode) {
-                        case 'c':      // colour (passes)
-                        {
-                            unsigned char *f = (unsigned char *) buf;
-                            unsigned char *t = (unsigned char *) buf;
-                            if (d > (int) sizeof (buf)) {
-                                perror("Too wide");
-                                return false;
-                            }
-                            l = fread ((char *)buf, 1, d, bitmap_file);
-                            if (l != d) {
-                                fprintf(stderr, "Bad bit data from gs %d/%d (y=%d)\n", l, d, y);
-                                return false;
-                            }
-                            while (l--) {
-                                // pack and pass check RGB
-                                int n = 0;
-                                int v = 0;
-                                int p = 0;
-                                int c = 0;
-                                for (c = 0; c < 3; c++) {
-                                    if (*f > 240) {
-                                        p |= (1 << c);
-                                    } else {
-                                        n++;
-                                        v += *f;
-                                    }
-                                    f++;
-                                }
-                                if (n) {
-                                    v /= n;
-                                } else {
-                                    p = 0;
-                                    v = 255;
-                                }
-                                if (p != pass) {
-                                    v = 255;
-                                }
-                                *t++ = 255 - v;
-                            }
-                        }
-                        break;
-                        case 'g':      // grey level
-                        {
-                            /* BMP padded to 4 bytes per scan line */
-                            int d = (h + 3) / 4 * 4;
-                            if (d > (int) sizeof (buf)) {
-                                fprintf(stderr, "Too wide\n");
-                                return false;
-                            }
-                            l = fread((char *)buf, 1, d, bitmap_file);
-                            if (l != d) {
-                                fprintf (stderr, "Bad bit data from gs %d/%d (y=%d)\n", l, d, y);
-                                return false;
-                            }
-                            for (l = 0; l < h; l++) {
-				if (invert)
-					buf[l] = (uint8_t) buf[l];
-				else
-					buf[l] = (255 - (uint8_t)buf[l]);
-                            }
-                        }
-                        break;
-                        default:       // mono
-                        {
-static int i;
-if (i++==0)
-printf("mono\n");
-                            int d = (h + 3) / 4 * 4;  // BMP padded to 4 bytes per scan line
-                            if (d > (int) sizeof (buf))
-                            {
-                                perror("Too wide");
-                                return false;
-                            }
-                            l = fread((char *) buf, 1, d, bitmap_file);
-                            if (l != d)
-                            {
-                                fprintf(stderr, "Bad bit data from gs %d/%d (y=%d)\n", l, d, y);
-                                return false;
-                            }
-                        }
-                        }
-
-                        if (raster_mode == 'c' || raster_mode == 'g') {
-                            for (l = 0; l < h; l++) {
-                                /* Raster value is multiplied by the
-                                 * power scale.
-                                 */
-                                buf[l] = (uint8_t)buf[l] * raster_power / 255;
-                            }
-                        }
-
-                        /* find left/right of data */
-                        for (l = 0; l < h && !buf[l]; l++) {
-                            ;
-                        }
-
-                        if (l < h) {
-                            /* a line to print */
-                            int r;
-                            int n;
-                            unsigned char pack[sizeof (buf) * 5 / 4 + 1];
-                            for (r = h - 1; r > l && !buf[r]; r--) {
-                                ;
-                            }
-                            r++;
-                            fprintf(pjl_file, "\e*p%dY", basey + offy + y);
-                            fprintf(pjl_file, "\e*p%dX", basex + offx +
-                                    ((raster_mode == 'c' || raster_mode == 'g') ? l : l * 8));
-                            if (dir) {
-                                fprintf(pjl_file, "\e*b%dA", -(r - l));
-                                // reverse bytes!
-                                for (n = 0; n < (r - l) / 2; n++){
-                                    unsigned char t = buf[l + n];
-                                    buf[l + n] = buf[r - n - 1];
-                                    buf[r - n - 1] = t;
-                                }
-                            } else {
-                                fprintf(pjl_file, "\e*b%dA", (r - l));
-                            }
-                            dir = 1 - dir;
-                            // pack
-                            n = 0;
-                            while (l < r) {
-                                int p;
-                                for (p = l; p < r && p < l + 128 && buf[p]
-                                         == buf[l]; p++) {
-                                    ;
-                                }
-                                if (p - l >= 2) {
-                                    // run length
-                                    pack[n++] = 257 - (p - l);
-                                    pack[n++] = buf[l];
-                                    l = p;
-                                } else {
-                                    for (p = l;
-                                         p < r && p < l + 127 &&
-                                             (p + 1 == r || buf[p] !=
-                                              buf[p + 1]);
-                                         p++) {
-                                        ;
-                                    }
-
-                                    pack[n++] = p - l - 1;
-                                    while (l < p) {
-                                        pack[n++] = buf[l++];
-                                    }
-                                }
-                            }
-                            fprintf(pjl_file, "\e*b%dW", (n + 7) / 8 * 8);
-                            r = 0;
-                            while (r < n)
-                                fputc(pack[r++], pjl_file);
-                            while (r & 7)
-                            {
-                                r++;
-                                fputc(0x80, pjl_file);
-                            }
-                        }
-                    }
-                }
-            }
-        }
-        fprintf(pjl_file, "\e*rC");       // end raster
-        fputc(26, pjl_file);      // some end of file markers
-        fputc(4, pjl_file);
-    }
-    return true;
+		if (i)
+			buf[len++] = ' ';
+		if (quote)
+			buf[len++] = '\'';
+		for (const char * c = arg ; *c ; c++)
+		{
+			if (quote && *c == '\'')
+			{
+				memcpy(buf + len, "'\\''", 4);
+				len += 4;
+			} else
+				buf[len++] = *c;
+		}
+		if (quote)
+			buf[len++] = '\'';
+	}
+
+	buf[len] = '\0';
+	return true;
 }
 
 
-typedef struct _vector vector_t;
-struct _vector
+#ifdef HAVE_LIBGS
+/** Where an in-process ghostscript run sends its stdout and stderr. */
+typedef struct
 {
-	vector_t * next;
-	vector_t ** prev;
-	int x1;
-	int y1;
-	int x2;
-	int y2;
-	int p;
-};
+	FILE * out;
+	FILE * err;
+} gs_stdio_t;
 
 
-typedef struct
+static int GSDLLCALL
+gs_stdin_fn(
+	void * const handle,
+	char * const buf,
+	const int len
+)
 {
-	vector_t * vectors;
-} vectors_t;
+	(void) handle;
+	(void) buf;
+	(void) len;
+	return 0;
+}
 
 
-static void
-vector_stats(
-	vector_t * v
+static int GSDLLCALL
+gs_stdout_fn(
+	void * const handle,
+	const char * const str,
+	const int len
 )
 {
-	int lx = 0;
-	int ly = 0;
-	long cut_len_sum = 0;
-	int cuts = 0;
+	const gs_stdio_t * const io = handle;
+	return fwrite(str, 1, len, io->out);
+}
 
-	long transit_len_sum = 0;
-	int transits = 0;
 
-	while (v)
-	{
-		long t_dx = lx - v->x1;
-		long t_dy = ly - v->y1;
+static int GSDLLCALL
+gs_stderr_fn(
+	void * const handle,
+	const char * const str,
+	const int len
+)
+{
+	const gs_stdio_t * const io = handle;
+	return fwrite(str, 1, len, io->err);
+}
 
-		long transit_len = sqrt(t_dx * t_dx + t_dy * t_dy);
-		if (transit_len != 0)
-		{
-			transits++;
-			transit_len_sum += transit_len;
+
+/** Run ghostscript in this process through the gsapi library.
+ *
+ * Every run gets an interpreter instance of its own, since an instance
+ * can only be initialized once and each run has different arguments.
+ * What is saved is the shell and the gs process, not the interpreter
+ * startup, which is still paid for every run.
+ *
+ * @return Return true if the interpreter exits cleanly, false otherwise.
+ */
+static bool
+gs_run(
+	gs_args_t * const args,
+	gs_stdio_t * const io
+)
+{
+	void * instance;
+	if (gsapi_new_instance(&instance, io) < 0)
+		return false;
+
+	gsapi_set_stdio(instance, gs_stdin_fn, gs_stdout_fn, gs_stderr_fn);
+	gsapi_set_arg_encoding(instance, GS_ARG_ENCODING_UTF8);
+
+	int rc = gsapi_init_with_args(instance, args->argc, args->argv);
+	const int exit_rc = gsapi_exit(instance);
+	if (rc == 0 || rc == GS_ERROR_QUIT)
+		rc = exit_rc;
+
+	gsapi_delete_instance(instance);
+	fflush(io->out);
+	return rc == 0;
+}
+
+
+/** The one streamed raster run, which the interpreter does on a thread. */
+static struct
+{
+	pthread_t thread;
+	gs_args_t args;
+	gs_stdio_t io;
+	bool ok;
+} gs_stream;
+
+
+static void *
+gs_stream_thread(
+	void * const arg
+)
+{
+	(void) arg;
+	gs_stream.ok = gs_run(&gs_stream.args, &gs_stream.io);
+
+	// Closing the pipe tells the raster encoder that the page is done
+	fclose(gs_stream.io.out);
+	return NULL;
+}
+#endif
+
+
+/**
+ * Run ghostscript to completion, sending its stdout to filename_stdout
+ * and, if it is not NULL, its stderr to filename_stderr.
+ *
+ * @return Return true if ghostscript succeeds, false otherwise.
+ */
+static bool
+gs_exec(
+	gs_args_t * const args,
+	const char * const filename_stdout,
+	const char * const filename_stderr
+)
+{
+	char buf[8192];
+	const bool command = gs_args_command(args, buf, sizeof(buf));
+
+#ifdef HAVE_LIBGS
+	if (debug && command)
+		printf("Executing: %s\n", buf);
+
+	gs_stdio_t io = {
+		.out = fopen(filename_stdout, "w"),
+		.err = filename_stderr ? fopen(filename_stderr, "w") : stderr,
+	};
+
+	bool ok = io.out && io.err && gs_run(args, &io);
+
+	if (io.out)
+		fclose(io.out);
+	if (io.err && io.err != stderr)
+		fclose(io.err);
+	return ok;
+#else
+	const size_t len = strlen(buf);
+	if (!command
+	||  (size_t) snprintf(buf + len, sizeof(buf) - len,
+		" > %s%s%s",
+		filename_stdout,
+		filename_stderr ? " 2> " : "",
+		filename_stderr ? filename_stderr : ""
+	) >= sizeof(buf) - len) {
+		fprintf(stderr, "gs command line is too long\n");
+		return false;
+	}
+
+	if (debug)
+		printf("Executing: %s\n", buf);
+
+	if (system(buf))
+		return false;
+
+	return true;
+#endif
+}
+
+
+/**
+ * Execute ghostscript feeding it an ecapsulated postscript file which is then
+ * converted into a bitmap image. As a byproduct output of the ghostscript
+ * process is redirected to a .vector file which will contain instructions on
+ * how to perform a vector cut of lines within the postscript.
+ *
+ * @param filename_bitmap the filename to use for the resulting bitmap file.
+ * @param filename_eps the filename to read in encapsulated postscript from.
+ * @param filename_vector the filename that will contain the vector
+ * information.
+ * @param bmp_mode a string which is one of bmp16m, bmpgray, or bmpmono.
+ * @param resolution the encapsulated postscript resolution.
+ *
+ * @return Return true if the execution of ghostscript succeeds, false
+ * otherwise.
+ */
+static bool
+execute_ghostscript(
+	const char * const filename_bitmap,
+	const char * const filename_eps,
+	const char * const filename_vector,
+	const char * const bmp_mode,
+	int resolution
+)
+{
+	gs_args_t args;
+	gs_args_init(&args, resolution);
+	gs_arg(&args, "-sDEVICE=%s", bmp_mode);
+	gs_arg(&args, "-sOutputFile=%s", filename_bitmap);
+	gs_args_bands(&args);
+	gs_args_window(&args);
+	gs_args_input(&args, filename_eps);
+
+	return gs_exec(&args, filename_vector, NULL);
+}
+
+
+/**
+ * Execute ghostscript with its raster written to a pipe instead of a
+ * temporary bitmap.  The BMP devices write the rows bottom up as the
+ * bands are rendered, which is the order they are rastered in, so the
+ * page can be encoded without ever holding the whole of it.
+ *
+ * @param filename_eps the filename to read in encapsulated postscript from.
+ * @param filename_vector the filename that will contain the vector
+ * information.
+ * @param bmp_mode a string which is one of bmpgray or bmpmono.
+ * @param resolution the encapsulated postscript resolution.
+ *
+ * @return Return the read end of the pipe, or NULL if ghostscript could
+ * not be started.
+ */
+static FILE *
+execute_ghostscript_stream(
+	const char * const filename_eps,
+	const char * const filename_vector,
+	const char * const bmp_mode,
+	int resolution
+)
+{
+	char buf[8192];
+
+#ifdef HAVE_LIBGS
+	gs_args_t * const args = &gs_stream.args;
+#else
+	gs_args_t args_buf;
+	gs_args_t * const args = &args_buf;
+#endif
+	gs_args_init(args, resolution);
+	gs_arg(args, "-sDEVICE=%s", bmp_mode);
+	gs_arg(args, "-sOutputFile=-");
+	gs_arg(args, "-sstdout=%s", filename_vector);
+	gs_args_bands(args);
+	gs_args_window(args);
+	gs_args_input(args, filename_eps);
+
+	const bool command = gs_args_command(args, buf, sizeof(buf));
+	if (debug && command)
+		printf("Executing: %s\n", buf);
+
+#ifdef HAVE_LIBGS
+	int fds[2];
+	if (pipe(fds) < 0)
+		return NULL;
+
+	gs_stream.io.out = fdopen(fds[1], "w");
+	gs_stream.io.err = stderr;
+	FILE * const gs_pipe = fdopen(fds[0], "r");
+	if (!gs_stream.io.out || !gs_pipe
+	||  pthread_create(&gs_stream.thread, NULL, gs_stream_thread, NULL) != 0)
+	{
+		close(fds[0]);
+		close(fds[1]);
+		return NULL;
+	}
+
+	return gs_pipe;
+#else
+	if (!command) {
+		fprintf(stderr, "gs command line is too long\n");
+		return NULL;
+	}
+	return popen(buf, "r");
+#endif
+}
+
+
+/**
+ * Run ghostscript with the bbox device to collect the vector records and
+ * the bounding box of everything that will be rastered.  The stroke
+ * prologue paints nothing for vector strokes, so they are not included.
+ * If there are raster marks, set up the raster window so that the render
+ * pass only draws that part of the page.
+ *
+ * @return Return 1 if there are raster marks, 0 if there are none, or -1
+ * if ghostscript failed.
+ */
+static int
+execute_ghostscript_bbox(
+	const char * const filename_eps,
+	const char * const filename_vector,
+	const char * const filename_bbox,
+	int resolution
+)
+{
+	char buf[8192];
+
+	gs_args_t args;
+	gs_args_init(&args, resolution);
+	gs_arg(&args, "-sDEVICE=bbox");
+	gs_args_input(&args, filename_eps);
+
+	if (!gs_exec(&args, filename_vector, filename_bbox))
+		return -1;
+
+	// The page height is needed to turn the bbox into device rows
+	int page_height = 0;
+	FILE * const vector_file = fopen(filename_vector, "r");
+	if (!vector_file)
+		return -1;
+	while (fgets(buf, sizeof(buf), vector_file)) {
+		int w;
+		if (sscanf(buf, "S%d,%d", &w, &page_height) == 2)
+			break;
+	}
+	fclose(vector_file);
+
+	int llx = 0, lly = 0, urx = 0, ury = 0;
+	FILE * const bbox_file = fopen(filename_bbox, "r");
+	if (!bbox_file)
+		return -1;
+	while (fgets(buf, sizeof(buf), bbox_file)) {
+		if (sscanf(buf, "%%%%BoundingBox: %d %d %d %d",
+			&llx, &lly, &urx, &ury) == 4)
+			break;
+	}
+	fclose(bbox_file);
+
+	if (urx <= llx || ury <= lly)
+		return 0;
+	if (page_height <= 0)
+		return 1; // render the whole page
+
+	raster_window_width = ((urx - llx) * resolution + POINTS_PER_INCH - 1) / POINTS_PER_INCH;
+	raster_window_height = ((ury - lly) * resolution + POINTS_PER_INCH - 1) / POINTS_PER_INCH;
+	raster_window_offset_x = -llx;
+	raster_window_offset_y = -lly;
+	raster_crop_x = llx * resolution / POINTS_PER_INCH;
+	raster_crop_y = (page_height - ury) * resolution / POINTS_PER_INCH;
+
+	printf("Raster window %dx%d at %d,%d\n",
+		raster_window_width, raster_window_height,
+		raster_crop_x, raster_crop_y);
+	return 1;
+}
+
+
+/**
+ * Drain and close a ghostscript raster pipe, which has to finish before
+ * its vector output is complete.
+ *
+ * @return Return true if ghostscript exited cleanly, false otherwise.
+ */
+static bool
+execute_ghostscript_finish(
+	FILE * const gs_pipe
+)
+{
+	char buf[4096];
+	while (fread(buf, 1, sizeof(buf), gs_pipe) > 0)
+		;
+
+#ifdef HAVE_LIBGS
+	fclose(gs_pipe);
+	pthread_join(gs_stream.thread, NULL);
+	return gs_stream.ok;
+#else
+	return pclose(gs_pipe) == 0;
+#endif
+}
+
+
+/**
+ * Wait for the next page of a ghostscript raster pipe.  gs writes the
+ * vector records of a page before its bitmap, so once the bitmap starts
+ * the records are complete.
+ *
+ * @return Return false if gs has no more pages.
+ */
+static bool
+raster_stream_next(
+	FILE * const gs_pipe
+)
+{
+	const int c = fgetc(gs_pipe);
+	if (c == EOF)
+		return false;
+
+	ungetc(c, gs_pipe);
+	return true;
+}
+
+
+/**
+ * Convert a pdf file to postscript.  The shell build uses the pdf2ps
+ * script; with the gsapi library the ps2write device is run in process.
+ *
+ * @return Return true if the conversion succeeds, false otherwise.
+ */
+static bool
+execute_pdf2ps(
+	const char * const filename_pdf,
+	const char * const filename_ps
+)
+{
+#ifdef HAVE_LIBGS
+	gs_args_t args;
+	gs_args_init(&args, 720);
+	gs_arg(&args, "-dSAFER");
+	gs_arg(&args, "-sDEVICE=ps2write");
+	gs_arg(&args, "-sOutputFile=%s", filename_ps);
+	gs_arg(&args, "%s", filename_pdf);
+
+	return gs_exec(&args, "/dev/null", NULL);
+#else
+	char buf[8192];
+	snprintf(buf, sizeof(buf), "pdf2ps %s %s", filename_pdf, filename_ps);
+	if (debug) {
+		printf("executing: %s\n", buf);
+	}
+
+	if (system(buf))
+		return false;
+
+	return true;
+#endif
+}
+
+
+/**
+ * Find the version of gs, as gs --version prints it.  It is only looked
+ * up once.
+ *
+ * @return Return the version, or "" if it cannot be found.
+ */
+static const char *
+gs_version(void)
+{
+	static char version[64];
+	static bool known = false;
+	if (known)
+		return version;
+	known = true;
+
+#ifdef HAVE_LIBGS
+	gsapi_revision_t rev;
+	if (gsapi_revision(&rev, sizeof(rev)) == 0)
+		snprintf(version, sizeof(version), "%ld.%02ld.%ld",
+			rev.revision / 1000,
+			rev.revision / 10 % 100,
+			rev.revision % 10);
+#else
+	FILE * const gs = popen("gs --version 2>/dev/null", "r");
+	if (!gs)
+		return version;
+	if (!fgets(version, sizeof(version), gs))
+		version[0] = '\0';
+	version[strcspn(version, "\n")] = '\0';
+	pclose(gs);
+#endif
+
+	if (debug)
+		printf("gs version %s\n", version);
+	return version;
+}
+
+
+/**
+ * Find whether gs still has the postscript based pdf interpreter that a
+ * pdf run directly after the prologue depends on.  The newer interpreter
+ * does not draw through the redefined stroke and fill operators, so the
+ * vectors would be rastered instead of cut.
+ *
+ * @return Return true if it does, or if the version cannot be found.
+ */
+static bool
+gs_has_ps_pdf(void)
+{
+	int major = 0, minor = 0;
+	if (sscanf(gs_version(), "%d.%d", &major, &minor) != 2)
+		return true;
+
+	return major * 100 + minor < GS_NO_PS_PDF;
+}
+
+
+/** A pool of worker threads that share a batch of indexed work items.
+ *
+ * The caller always participates in the batch, so a pool with a single
+ * thread does not start any extra threads at all.
+ */
+typedef void (*worker_fn_t)(void * arg, int index);
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	pthread_t * threads;
+	int nthreads;
+	int shutdown;
+	unsigned generation;
+	worker_fn_t fn;
+	void * arg;
+	int next;
+	int count;
+	int finished;
+} worker_pool_t;
+
+
+/** Claim and run items from the current batch until none are left.
+ * Must be called with the pool lock held; returns with it held.
+ */
+static void
+worker_pool_drain(
+	worker_pool_t * const pool
+)
+{
+	while (pool->next < pool->count)
+	{
+		const worker_fn_t fn = pool->fn;
+		void * const arg = pool->arg;
+		const int index = pool->next++;
+
+		pthread_mutex_unlock(&pool->lock);
+		fn(arg, index);
+		pthread_mutex_lock(&pool->lock);
+
+		if (++pool->finished == pool->count)
+			pthread_cond_broadcast(&pool->done);
+	}
+}
+
+
+static void *
+worker_pool_thread(
+	void * const pool_ptr
+)
+{
+	worker_pool_t * const pool = pool_ptr;
+	unsigned generation = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1)
+	{
+		while (!pool->shutdown && pool->generation == generation)
+			pthread_cond_wait(&pool->start, &pool->lock);
+		if (pool->shutdown)
+			break;
+
+		generation = pool->generation;
+		worker_pool_drain(pool);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+
+/** Create a pool with nthreads workers in total, including the caller.
+ * If nthreads is zero, use one per online processor.
+ */
+static worker_pool_t *
+worker_pool_create(
+	int nthreads
+)
+{
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+
+	worker_pool_t * const pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pool->nthreads = 1;
+
+	pool->threads = calloc(nthreads, sizeof(*pool->threads));
+	if (!pool->threads)
+		return pool;
+
+	// Thread creation failures just leave us with a smaller pool
+	for (int i = 1 ; i < nthreads ; i++)
+	{
+		if (pthread_create(
+			&pool->threads[pool->nthreads - 1],
+			NULL,
+			worker_pool_thread,
+			pool
+		) != 0)
+			break;
+		pool->nthreads++;
+	}
+
+	if (debug)
+		printf("Worker pool: %d threads\n", pool->nthreads);
+
+	return pool;
+}
+
+
+/** Run fn(arg, i) for every i in [0,count) and wait for all of them. */
+static void
+worker_pool_run(
+	worker_pool_t * const pool,
+	const worker_fn_t fn,
+	void * const arg,
+	const int count
+)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->fn = fn;
+	pool->arg = arg;
+	pool->next = 0;
+	pool->count = count;
+	pool->finished = 0;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start);
+
+	worker_pool_drain(pool);
+	while (pool->finished != pool->count)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+
+static void
+worker_pool_destroy(
+	worker_pool_t * const pool
+)
+{
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 0 ; i < pool->nthreads - 1 ; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->start);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
+
+
+static bool
+pjl_flush(
+	pjl_buf_t * const job
+)
+{
+	if (job->sink && job->len) {
+		if (fwrite(job->data, 1, job->len, job->sink) != job->len)
+			job->failed = true;
+		/* A copy for the cache; losing it doesn't fail the job */
+		if (job->tee)
+			fwrite(job->data, 1, job->len, job->tee);
+		job->len = 0;
+	}
+
+	return !job->failed;
+}
+
+
+/** Make room for len more bytes and return where they go. */
+static uint8_t *
+pjl_reserve(
+	pjl_buf_t * const job,
+	const size_t len
+)
+{
+	if (job->sink && job->len + len > PJL_FLUSH_NBYTES)
+		pjl_flush(job);
+
+	if (job->len + len > job->size) {
+		size_t size = job->size ? job->size : PJL_FLUSH_NBYTES;
+		while (size < job->len + len)
+			size *= 2;
+		uint8_t * const data = realloc(job->data, size);
+		if (!data) {
+			perror("pjl buffer");
+			abort();
+		}
+		job->data = data;
+		job->size = size;
+	}
+
+	return job->data + job->len;
+}
+
+
+static void
+pjl_append(
+	pjl_buf_t * const job,
+	const void * const data,
+	const size_t len
+)
+{
+	memcpy(pjl_reserve(job, len), data, len);
+	job->len += len;
+}
+
+
+static void
+pjl_puts(
+	pjl_buf_t * const job,
+	const char * const str
+)
+{
+	pjl_append(job, str, strlen(str));
+}
+
+
+static void
+pjl_putc(
+	pjl_buf_t * const job,
+	const uint8_t c
+)
+{
+	*pjl_reserve(job, 1) = c;
+	job->len++;
+}
+
+
+/** Format an integer, returning the end of the digits. */
+static char *
+pjl_itoa(
+	char * out,
+	const int value
+)
+{
+	char digits[12];
+	int n = 0;
+	unsigned v = value < 0 ? -(unsigned) value : (unsigned) value;
+
+	do {
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+
+	if (value < 0)
+		*out++ = '-';
+	while (n)
+		*out++ = digits[--n];
+
+	return out;
+}
+
+
+static void
+pjl_int(
+	pjl_buf_t * const job,
+	const int value
+)
+{
+	char * const out = (char *) pjl_reserve(job, 12);
+	job->len += pjl_itoa(out, value) - out;
+}
+
+
+/** Append a command with a single integer, such as "\e*r" 1 "A". */
+static void
+pjl_cmd(
+	pjl_buf_t * const job,
+	const char * const prefix,
+	const int value,
+	const char * const suffix
+)
+{
+	pjl_puts(job, prefix);
+	pjl_int(job, value);
+	pjl_puts(job, suffix);
+}
+
+
+static void
+pjl_printf(
+	pjl_buf_t * const job,
+	const char * const fmt,
+	...
+)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	const int len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	char * const out = (char *) pjl_reserve(job, len + 1);
+	va_start(ap, fmt);
+	vsnprintf(out, len + 1, fmt, ap);
+	va_end(ap);
+	job->len += len;
+}
+
+
+static void
+pjl_free(
+	pjl_buf_t * const job
+)
+{
+	free(job->data);
+	job->data = NULL;
+	job->len = job->size = 0;
+}
+
+
+/** Start a job; this first line is the only one that names it. */
+static void
+pjl_job_name(
+	pjl_buf_t * const job
+)
+{
+	pjl_printf(job, "\e%%-12345X@PJL JOB NAME=%s\r\n", job_title);
+}
+
+
+/** One bitmap scan line on its way through the raster encoder. */
+typedef struct
+{
+	uint8_t * raw; // scan line as read from the bitmap
+	uint8_t * row; // power levels, one byte per output byte
+	uint8_t * out; // encoded PCL for this row
+	size_t out_len;
+	int y;
+	int k; // order in which the row is rastered
+	int l; // first non-zero byte
+	int r; // one past the last non-zero byte; l == r is blank
+	int dir;
+	int mode; // compression mode of the encoded row
+	uint8_t * cells; // halftone decisions, one per dot
+	int ht_lead; // row whose cells this row repeats; -1 is the carry
+	int ht_prev; // previous lead row in the band, or -1
+	int ht_done; // cells decided so far
+} raster_row_t;
+
+
+/** A rectangle of the bitmap that is rastered as its own block.
+ * Columns are in output bytes and rows in bitmap rows, both half-open.
+ */
+typedef struct
+{
+	int x0;
+	int x1;
+	int y0;
+	int y1;
+} raster_region_t;
+
+
+/** A band of scan lines that is encoded in parallel. */
+typedef struct
+{
+	raster_row_t * rows;
+	int nrows;
+	int pass; // colour pass, or -1 for any pass
+	int h; // bytes per output row
+	int d; // bytes per bitmap scan line
+	int x; // bitmap origin on the bed
+	int y;
+	int x0; // columns of the current region
+	int x1;
+	int stream; // rows arrive from a pipe and can't be re-read
+	int mode; // compression mode of the raster block
+	int wire_mode; // compression mode most recently sent
+	size_t out_size;
+	uint8_t * map; // tile occupancy, when building the island map
+	int tiles; // tiles per map row
+	int ncells; // halftone dots per row
+	int * ht_err; // error diffusion ring of HALFTONE_ERR_ROWS rows
+	uint8_t * ht_thr; // ordered dither thresholds, 8 rows of width
+	uint8_t * ht_cells; // decisions for every row in the band
+	uint8_t * ht_carry; // decisions of the last lead row of the previous band
+	int ht_carry_valid;
+} raster_band_t;
+
+
+/** 8x8 Bayer matrix for ordered dither. */
+static const uint8_t halftone_bayer[8][8] = {
+	{  0, 32,  8, 40,  2, 34, 10, 42 },
+	{ 48, 16, 56, 24, 50, 18, 58, 26 },
+	{ 12, 44,  4, 36, 14, 46,  6, 38 },
+	{ 60, 28, 52, 20, 62, 30, 54, 22 },
+	{  3, 35, 11, 43,  1, 33,  9, 41 },
+	{ 51, 19, 59, 27, 49, 17, 57, 25 },
+	{ 15, 47,  7, 39, 13, 45,  5, 37 },
+	{ 63, 31, 55, 23, 61, 29, 53, 21 },
+};
+
+
+/** Allocate the halftone state for a band of grey scan lines. */
+static bool
+raster_halftone_init(
+	raster_band_t * const band
+)
+{
+	const int ncells = (width + halftone_dot - 1) / halftone_dot;
+	const int stride = (width + 15) / 16 * 16;
+
+	band->ncells = ncells;
+	band->ht_err = calloc((size_t) HALFTONE_ERR_ROWS * (ncells + 4), sizeof(*band->ht_err));
+	band->ht_thr = calloc(8, stride);
+	band->ht_cells = malloc((size_t) RASTER_BAND_ROWS * ncells);
+	band->ht_carry = malloc(ncells);
+	if (!band->ht_err || !band->ht_thr || !band->ht_cells || !band->ht_carry)
+		return false;
+
+	for (int i = 0 ; i < RASTER_BAND_ROWS ; i++)
+		band->rows[i].cells = band->ht_cells + (size_t) i * ncells;
+
+	/* A pixel is burned if it is darker than its threshold; anything
+	 * past the end of the row has a threshold of zero and never is.
+	 */
+	for (int j = 0 ; j < 8 ; j++)
+	{
+		uint8_t * const thr = band->ht_thr + j * stride;
+		for (int x = 0 ; x < width ; x++)
+			thr[x] = 255 - (halftone_bayer[j][(x / halftone_dot) % 8] * 4 + 2);
+	}
+
+	return true;
+}
+
+
+static void
+raster_halftone_free(
+	raster_band_t * const band
+)
+{
+	free(band->ht_err);
+	free(band->ht_thr);
+	free(band->ht_cells);
+	free(band->ht_carry);
+	band->ht_err = NULL;
+	band->ht_thr = NULL;
+	band->ht_cells = NULL;
+	band->ht_carry = NULL;
+}
+
+
+/** Forget any error diffusion state before starting a new scan. */
+static void
+raster_halftone_reset(
+	raster_band_t * const band
+)
+{
+	if (!band->ht_err)
+		return;
+
+	memset(band->ht_err, 0,
+		(size_t) HALFTONE_ERR_ROWS * (band->ncells + 4) * sizeof(*band->ht_err));
+	band->ht_carry_valid = 0;
+}
+
+
+static inline uint8_t
+bit_reverse(
+	const unsigned x
+)
+{
+	return ((x * 0x0202020202ULL) & 0x010884422010ULL) % 1023;
+}
+
+
+/** Ordered dither the columns [x0,x1) of a grey row into packed bits.
+ *
+ * Every pixel is independent, so with SSE2 sixteen pixels are compared
+ * against their thresholds at once.
+ */
+static void
+raster_halftone_ordered(
+	const raster_band_t * const band,
+	const raster_row_t * const row,
+	uint8_t * const buf
+)
+{
+	const int stride = (width + 15) / 16 * 16;
+	const int j = (row->k / halftone_dot) % 8;
+	const uint8_t * const thr = band->ht_thr + j * stride;
+	const uint8_t * const g = row->raw;
+	int b = band->x0;
+
+#ifdef __SSE2__
+	const __m128i bias = _mm_set1_epi8((char) 0x80);
+	for ( ; b + 2 <= band->x1 && b * 8 + 16 <= width ; b += 2)
+	{
+		// There is no unsigned byte compare, so bias both sides
+		const __m128i gv = _mm_xor_si128(bias,
+			_mm_loadu_si128((const void *) &g[b * 8]));
+		const __m128i tv = _mm_xor_si128(bias,
+			_mm_loadu_si128((const void *) &thr[b * 8]));
+		const int m = _mm_movemask_epi8(_mm_cmplt_epi8(gv, tv));
+
+		// movemask puts the first pixel in the lsb
+		buf[b + 0] = bit_reverse(m & 0xFF);
+		buf[b + 1] = bit_reverse(m >> 8);
+	}
+#endif
+
+	for ( ; b < band->x1 ; b++)
+	{
+		uint8_t bits = 0;
+		for (int k = 0 ; k < 8 ; k++)
+		{
+			const int x = b * 8 + k;
+			bits = bits << 1 | (x < width && g[x] < thr[x]);
+		}
+		buf[b] = bits;
+	}
+}
+
+
+/** Wait for another row to have decided at least n cells. */
+static void
+raster_halftone_wait(
+	const raster_row_t * const row,
+	const int n
+)
+{
+	while (__atomic_load_n(&row->ht_done, __ATOMIC_ACQUIRE) < n)
+		sched_yield();
+}
+
+
+/** Error diffuse one row of halftone cells.
+ *
+ * Error flows down into the next one (Floyd-Steinberg) or two (Jarvis)
+ * rows, so rows are run as a wavefront: each row works in chunks and
+ * waits for the row before it to be far enough ahead that every error
+ * it reads is final and no two rows ever add into the same cell.
+ * The error ring is kept scaled by the filter divisor to avoid
+ * rounding.
+ */
+static void
+raster_halftone_diffuse(
+	const raster_band_t * const band,
+	raster_row_t * const row
+)
+{
+	const int jarvis = halftone_mode == 'j';
+	const int div = jarvis ? 48 : 16;
+	const int lag = jarvis ? 5 : 2;
+	const int n = band->ncells;
+	const int stride = n + 4;
+	const int cr = row->k / halftone_dot;
+	int * const e0 = band->ht_err + (cr + 0) % HALFTONE_ERR_ROWS * stride + 2;
+	int * const e1 = band->ht_err + (cr + 1) % HALFTONE_ERR_ROWS * stride + 2;
+	int * const e2 = band->ht_err + (cr + 2) % HALFTONE_ERR_ROWS * stride + 2;
+	const raster_row_t * const prev = row->ht_prev < 0 ? NULL
+		: &band->rows[row->ht_prev];
+	const uint8_t * const g = row->raw;
+	uint8_t * const cells = row->cells;
+	int carry1 = 0;
+	int carry2 = 0;
+
+	// Nothing has written to the furthest row of the ring yet
+	memset((jarvis ? e2 : e1) - 2, 0, stride * sizeof(*e0));
+
+	for (int c = 0 ; c < n ; c += HALFTONE_CHUNK)
+	{
+		const int end = c + HALFTONE_CHUNK < n ? c + HALFTONE_CHUNK : n;
+		if (prev)
+			raster_halftone_wait(prev, end + lag < n ? end + lag : n);
+
+		for (int x = c ; x < end ; x++)
+		{
+			const int in = carry1;
+			carry1 = carry2;
+			carry2 = 0;
+
+			const int v = (255 - g[x * halftone_dot]) * div + e0[x] + in;
+			const int dot = v >= 128 * div;
+			const int e = dot ? v - 255 * div : v;
+			cells[x] = dot;
+
+			if (jarvis)
+			{
+				carry1 += e * 7 / 48;
+				carry2 += e * 5 / 48;
+				e1[x - 2] += e * 3 / 48;
+				e1[x - 1] += e * 5 / 48;
+				e1[x + 0] += e * 7 / 48;
+				e1[x + 1] += e * 5 / 48;
+				e1[x + 2] += e * 3 / 48;
+				e2[x - 2] += e * 1 / 48;
+				e2[x - 1] += e * 3 / 48;
+				e2[x + 0] += e * 5 / 48;
+				e2[x + 1] += e * 3 / 48;
+				e2[x + 2] += e * 1 / 48;
+			} else {
+				carry1 += e * 7 / 16;
+				e1[x - 1] += e * 3 / 16;
+				e1[x + 0] += e * 5 / 16;
+				e1[x + 1] += e * 1 / 16;
+			}
+		}
+
+		__atomic_store_n(&row->ht_done, end, __ATOMIC_RELEASE);
+	}
+}
+
+
+/** Halftone a grey scan line into packed mono bits.
+ *
+ * Error diffusion always works on the full row, so the dots of an
+ * island don't depend on where its columns start; the bits are only
+ * packed for the columns of the current region.  The error is reset
+ * at the start of each region, so an island does not see the error
+ * carried down from the rows of the islands rastered before it.
+ */
+static void
+raster_halftone_row(
+	const raster_band_t * const band,
+	raster_row_t * const row,
+	uint8_t * const buf
+)
+{
+	if (halftone_mode == 'o')
+	{
+		raster_halftone_ordered(band, row, buf);
+		return;
+	}
+
+	const uint8_t * cells;
+	if (row->ht_lead == row - band->rows)
+	{
+		raster_halftone_diffuse(band, row);
+		cells = row->cells;
+	} else
+	if (row->ht_lead >= 0)
+	{
+		// Repeat the decisions of the first row of this dot
+		const raster_row_t * const lead = &band->rows[row->ht_lead];
+		raster_halftone_wait(lead, band->ncells);
+		cells = lead->cells;
+	} else {
+		cells = band->ht_carry;
+	}
+
+	for (int b = band->x0 ; b < band->x1 ; b++)
+	{
+		uint8_t bits = 0;
+		for (int k = 0 ; k < 8 ; k++)
+		{
+			const int x = b * 8 + k;
+			bits = bits << 1 | (x < width && cells[x / halftone_dot]);
+		}
+		buf[b] = bits;
+	}
+}
+
+
+/** Build the grey level to power table.
+ *
+ * This folds the inversion (white is no power), the material response
+ * curve and the raster power scale into one lookup.  With no curve
+ * loaded it is exactly the old (255 - grey) * power / 255.  White
+ * never burns, whatever the curve says.
+ */
+static void
+raster_lut_build(void)
+{
+	const bool linear = curve_gamma == 1.0 && curve_points == 0;
+
+	for (int g = 0 ; g < 256 ; g++)
+	{
+		int dark = 255 - g;
+
+		if (!linear)
+		{
+			double t = pow(dark / 255.0, curve_gamma) * 100;
+
+			if (curve_points)
+			{
+				// piecewise linear, flat past either end
+				int i = 0;
+				while (i < curve_points && curve_point[i].in < t)
+					i++;
+
+				if (i == 0)
+					t = curve_point[0].out;
+				else
+				if (i == curve_points)
+					t = curve_point[curve_points - 1].out;
+				else {
+					const double x0 = curve_point[i - 1].in;
+					const double x1 = curve_point[i].in;
+					const double y0 = curve_point[i - 1].out;
+					const double y1 = curve_point[i].out;
+					t = y0 + (y1 - y0) * (t - x0) / (x1 - x0);
+				}
+			}
+
+			dark = lround(t * 255 / 100);
+			if (dark < 0)
+				dark = 0;
+			if (dark > 255)
+				dark = 255;
+		}
+
+		raster_lut[g] = dark * raster_power / 255;
+	}
+
+	raster_lut[255] = 0;
+
+	if (debug > 1)
+		for (int g = 0 ; g < 256 ; g += 16)
+			printf("LUT %3d: %3d\n", g, raster_lut[g]);
+}
+
+
+/**
+ * Load a material response curve.
+ *
+ * The file has one setting per line, with # comments:
+ *   gamma G        -- darkness is raised to the power G first
+ *   point IN OUT   -- darkness IN% is burned at OUT% of the raster power
+ *
+ * Points must be in increasing order of IN and are linearly
+ * interpolated.
+ */
+static bool
+curve_load(
+	const char * const filename
+)
+{
+	FILE * const f = fopen(filename, "r");
+	if (!f)
+	{
+		perror(filename);
+		return false;
+	}
+
+	char line[256];
+	int lineno = 0;
+	curve_points = 0;
+
+	while (fgets(line, sizeof(line), f))
+	{
+		double a, b;
+		lineno++;
+
+		char * const comment = strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+
+		if (sscanf(line, " gamma %lf", &a) == 1 && a > 0)
+		{
+			curve_gamma = a;
+		} else
+		if (sscanf(line, " point %lf %lf", &a, &b) == 2)
+		{
+			if (curve_points == CURVE_MAX_POINTS
+			|| (curve_points && a <= curve_point[curve_points - 1].in))
+				goto bad;
+			curve_point[curve_points].in = a;
+			curve_point[curve_points].out = b;
+			curve_points++;
+		} else {
+			char word[2];
+			if (sscanf(line, " %1s", word) == 1)
+				goto bad;
+		}
+	}
+
+	fclose(f);
+	return true;
+
+bad:
+	fprintf(stderr, "%s:%d: bad curve line\n", filename, lineno);
+	fclose(f);
+	return false;
+}
+
+
+/** Map a run of grey levels to power levels through the table. */
+static void
+raster_lut_apply(
+	uint8_t * const out,
+	const uint8_t * const in,
+	const int n
+)
+{
+	for (int i = 0 ; i < n ; i++)
+		out[i] = raster_lut[in[i]];
+}
+
+
+/** Convert a scan line into power levels and find its extent.
+ *
+ * Only the columns of the current region are converted.  Each row is
+ * independent, so this is safe to run on any thread.
+ */
+static void
+raster_convert_row(
+	void * const band_ptr,
+	const int index
+)
+{
+	const raster_band_t * const band = band_ptr;
+	raster_row_t * const row = &band->rows[index];
+	const uint8_t * const raw = row->raw;
+	uint8_t * const buf = row->row;
+	const int x0 = band->x0;
+	const int x1 = band->x1;
+	int l;
+
+	switch (raster_mode)
+	{
+	case 'c':
+		// colour (passes), pack and pass check RGB
+		for (l = x0 ; l < x1 ; l++)
+		{
+			const uint8_t * const f = &raw[l * 3];
+			int n = 0;
+			int v = 0;
+			int p = 0;
+
+			for (int c = 0 ; c < 3 ; c++)
+			{
+				if (f[c] > 240)
+				{
+					p |= (1 << c);
+				} else {
+					n++;
+					v += f[c];
+				}
+			}
+
+			if (n)
+			{
+				v /= n;
+			} else {
+				p = 0;
+				v = 255;
+			}
+
+			if (p != band->pass && band->pass >= 0)
+				v = 255;
+
+			buf[l] = raster_lut[v];
+		}
+		break;
+	case 'g':
+		// grey level
+		raster_lut_apply(buf + x0, raw + x0, x1 - x0);
+		break;
+	default:
+		// mono is already one bit per pixel, unless we halftone it
+		if (halftone_mode)
+			raster_halftone_row(band, row, buf);
+		else
+			memcpy(buf + x0, raw + x0, x1 - x0);
+		break;
+	}
+
+	if (band->map)
+	{
+		// Record which tiles have anything in them
+		uint8_t * const map = &band->map[row->y * band->tiles];
+		for (l = x0 ; l < x1 ; l++)
+			if (buf[l])
+				map[l / RASTER_ISLAND_TILE] = 1;
+	}
+
+	// find left/right of data
+	for (l = x0 ; l < x1 && !buf[l] ; l++)
+		;
+
+	int r = l;
+	if (l < x1)
+	{
+		for (r = x1 - 1 ; r > l && !buf[r] ; r--)
+			;
+		r++;
+	}
+
+	row->l = l;
+	row->r = r;
+}
+
+
+/** Reverse the bytes of rows that are rastered right to left.
+ *
+ * This is done as its own phase so that the packer can compare each
+ * row against the previous one in the order it is sent.
+ */
+static void
+raster_reverse_row(
+	void * const band_ptr,
+	const int index
+)
+{
+	const raster_band_t * const band = band_ptr;
+	raster_row_t * const row = &band->rows[index];
+	uint8_t * const buf = row->row;
+	const int l = row->l;
+	const int r = row->r;
+
+	if (!row->dir)
+		return;
+
+	// reverse bytes!
+	for (int n = 0 ; n < (r - l) / 2 ; n++)
+	{
+		const uint8_t t = buf[l + n];
+		buf[l + n] = buf[r - n - 1];
+		buf[r - n - 1] = t;
+	}
+}
+
+
+/** PackBits encode a row, padding it with no-ops to a multiple of 8.
+ * @return The number of bytes written to pack.
+ */
+static int
+raster_packbits(
+	uint8_t * const pack,
+	const uint8_t * const buf,
+	int l,
+	const int r
+)
+{
+	int n = 0;
+
+	while (l < r)
+	{
+		int p;
+		for (p = l ; p < r && p < l + 128 && buf[p] == buf[l] ; p++)
+			;
+
+		if (p - l >= 2)
+		{
+			// run length
+			pack[n++] = 257 - (p - l);
+			pack[n++] = buf[l];
+			l = p;
+		} else {
+			for (p = l ;
+			     p < r && p < l + 127 && (p + 1 == r || buf[p] != buf[p + 1]) ;
+			     p++)
+				;
+
+			pack[n++] = p - l - 1;
+			while (l < p)
+				pack[n++] = buf[l++];
+		}
+	}
+
+	const int padded = (n + 7) / 8 * 8;
+	while (n < padded)
+		pack[n++] = 0x80;
+
+	return n;
+}
+
+
+/** Encode one non-blank row into its output buffer.
+ *
+ * The bytes must already be in the order they are sent.  In automatic
+ * compression mode the row is also tried as raw bytes, and the smaller
+ * of the two is used.
+ */
+static void
+raster_pack_row(
+	void * const band_ptr,
+	const int index
+)
+{
+	const raster_band_t * const band = band_ptr;
+	raster_row_t * const row = &band->rows[index];
+	const uint8_t * const buf = row->row;
+	uint8_t * const out = row->out;
+	const int l = row->l;
+	const int r = row->r;
+
+	row->out_len = 0;
+	if (l == r)
+		return;
+
+	// Leave room for the row header, which is written once the
+	// packed length is known.
+	uint8_t * const pack = out + 64;
+	int n = raster_packbits(pack, buf, l, r);
+	row->mode = band->mode;
+
+	if (raster_compress_auto)
+	{
+		const int raw = (r - l + 7) / 8 * 8;
+		if (raw < n)
+		{
+			// Padding is zero power past the end of the row
+			memcpy(pack, buf + l, r - l);
+			memset(pack + r - l, 0, raw - (r - l));
+			n = raw;
+			row->mode = RASTER_COMPRESS_RAW;
+		}
+	}
+
+	// "\e*p%dY\e*p%dX\e*b%dA\e*b%dW"
+	const int width = r - l;
+	char header[64];
+	char * h = header;
+	memcpy(h, "\e*p", 3); h += 3;
+	h = pjl_itoa(h, band->y + row->y);
+	memcpy(h, "Y\e*p", 4); h += 4;
+	h = pjl_itoa(h, band->x + ((raster_mode == 'c' || raster_mode == 'g')
+		? l : l * 8));
+	memcpy(h, "X\e*b", 4); h += 4;
+	h = pjl_itoa(h, row->dir ? -width : width);
+	memcpy(h, "A\e*b", 4); h += 4;
+	h = pjl_itoa(h, n);
+	*h++ = 'W';
+	const int header_len = h - header;
+
+	memmove(out, header, header_len);
+	memmove(out + header_len, pack, n);
+	row->out_len = header_len + n;
+}
+
+
+/** Read the rows of a region from the bottom up and encode them.
+ *
+ * Scan lines are read in bands of RASTER_BAND_ROWS and each band is
+ * converted and packed on the worker pool; only the bidirectional
+ * parity assignment and the output itself are done in order.  If
+ * job is NULL the rows are only converted, which is used to build
+ * the island map.
+ */
+static bool
+raster_encode_region(
+	pjl_buf_t * const job,
+	FILE * const bitmap_file,
+	worker_pool_t * const pool,
+	raster_band_t * const band,
+	const long base_offset,
+	const raster_region_t * const region
+)
+{
+	raster_row_t * const rows = band->rows;
+	const int d = band->d;
+	const int nrows = region->y1 - region->y0;
+	int n = 0;
+	char dir = 0;
+
+	band->x0 = region->x0;
+	band->x1 = region->x1;
+	raster_halftone_reset(band);
+
+	/* BMP rows are stored bottom up, which is the order we raster
+	 * them.  A streamed BMP can't seek, but its only region is the
+	 * whole page and the rows arrive in that order.
+	 */
+	if (!band->stream)
+		fseek(bitmap_file, base_offset + (long) (height - region->y1) * d, SEEK_SET);
+
+	while (n < nrows) {
+		int i;
+		int lead = -1;
+
+		/* Reading the bitmap has to be in order */
+		for (i = 0; i < RASTER_BAND_ROWS && n < nrows; i++, n++) {
+			const int y = region->y1 - 1 - n;
+			const int l = fread(rows[i].raw, 1, d, bitmap_file);
+			if (l != d) {
+				fprintf(stderr, "Bad bit data from gs %d/%d (y=%d)\n", l, d, y);
+				return false;
+			}
+			rows[i].y = y;
+			rows[i].k = height - 1 - y;
+
+			/* The first row of each halftone dot decides it and
+			 * the rest repeat it.
+			 */
+			rows[i].ht_done = 0;
+			rows[i].ht_prev = lead;
+			if (rows[i].k % halftone_dot == 0
+			||  (lead < 0 && !band->ht_carry_valid))
+				lead = i;
+			rows[i].ht_lead = lead;
+		}
+		band->nrows = i;
+
+		worker_pool_run(pool, raster_convert_row, band, band->nrows);
+
+		if (band->ht_err && lead >= 0) {
+			memcpy(band->ht_carry, rows[lead].cells, band->ncells);
+			band->ht_carry_valid = 1;
+		}
+
+		if (!job)
+			continue;
+
+		/* Only rows that are printed flip the direction. */
+		for (i = 0; i < band->nrows; i++) {
+			raster_row_t * const row = &rows[i];
+			row->dir = dir;
+			if (row->l != row->r)
+				dir = 1 - dir;
+		}
+
+		worker_pool_run(pool, raster_reverse_row, band, band->nrows);
+		worker_pool_run(pool, raster_pack_row, band, band->nrows);
+
+		for (i = 0; i < band->nrows; i++) {
+			const raster_row_t * const row = &rows[i];
+			if (!row->out_len)
+				continue;
+
+			if (row->mode != band->wire_mode) {
+				pjl_cmd(job, "\e*b", row->mode, "M");
+				band->wire_mode = row->mode;
+			}
+
+			pjl_append(job, row->out, row->out_len);
+
+			/* Each row is a sweep of the head past its ends. */
+			const int px = (row->r - row->l)
+				* (raster_mode == 'c' || raster_mode == 'g' ? 1 : 8);
+			page_time_raster += laser_row_time(px, resolution, raster_speed);
+
+			raster_stats.rows[row->mode]++;
+			raster_stats.bytes[row->mode] += row->out_len;
+		}
+	}
+
+	return true;
+}
+
+
+/** A rectangle of the island map being cut, in tiles and rows. */
+typedef struct
+{
+	raster_region_t r;
+	raster_region_t a;
+	raster_region_t b;
+	int cut;
+	int start;
+	int stage;
+} raster_island_frame_t;
+
+
+/**
+ * Shrink a rectangle of the island map to its contents and find where to
+ * cut it.  The occupied tiles of each row and column are counted in one
+ * pass, and everything else is found from the counts.  The cut is at the
+ * widest run of empty columns that is at least gap tiles wide, or failing
+ * that at the widest run of blank rows.
+ *
+ * @return 'x' or 'y' for a cut between halves a and b, 0 for no cut, or
+ * -1 if the rectangle is empty.
+ */
+static int
+raster_island_cut(
+	const uint8_t * const map,
+	const int tiles,
+	const int gap,
+	int * const rows,
+	int * const cols,
+	raster_island_frame_t * const f
+)
+{
+	raster_region_t * const r = &f->r;
+
+	memset(rows + r->y0, 0, (r->y1 - r->y0) * sizeof(*rows));
+	memset(cols + r->x0, 0, (r->x1 - r->x0) * sizeof(*cols));
+	for (int y = r->y0 ; y < r->y1 ; y++)
+		for (int t = r->x0 ; t < r->x1 ; t++)
+			if (map[y * tiles + t])
+			{
+				rows[y]++;
+				cols[t]++;
+			}
+
+	// Shrink to the bounding box of the occupied tiles
+	while (r->y0 < r->y1 && !rows[r->y0])
+		r->y0++;
+	while (r->y1 > r->y0 && !rows[r->y1 - 1])
+		r->y1--;
+	if (r->y0 == r->y1)
+		return -1;
+	while (!cols[r->x0])
+		r->x0++;
+	while (!cols[r->x1 - 1])
+		r->x1--;
+
+	/* Look for the widest vertical gap between the columns.  Of gaps
+	 * that are as wide the one nearest the middle is taken, which keeps
+	 * the cuts of a striped page balanced.
+	 */
+	int best_len = 0;
+	int best = 0;
+	for (int t = r->x0 ; t < r->x1 ; )
+	{
+		int e = t;
+		while (e < r->x1 && !cols[e])
+			e++;
+		if (e - t > best_len || (e - t == best_len && best_len
+		&&  abs(t + e - r->x0 - r->x1) < abs(2 * best + best_len - r->x0 - r->x1)))
+		{
+			best_len = e - t;
+			best = t;
+		}
+		t = e + 1;
+	}
+
+	f->a = f->b = *r;
+	if (best_len >= gap)
+	{
+		f->a.x1 = best;
+		f->b.x0 = best + best_len;
+		return 'x';
+	}
+
+	// No useful column gap; look for the widest run of blank rows
+	best_len = 0;
+	for (int y = r->y0 ; y < r->y1 ; )
+	{
+		int e = y;
+		while (e < r->y1 && !rows[e])
+			e++;
+		if (e - y > best_len || (e - y == best_len && best_len
+		&&  abs(y + e - r->y0 - r->y1) < abs(2 * best + best_len - r->y0 - r->y1)))
+		{
+			best_len = e - y;
+			best = y;
+		}
+		y = e + 1;
+	}
+
+	if (!best_len)
+		return 0;
+
+	f->a.y1 = best;
+	f->b.y0 = best + best_len;
+	return 'y';
+}
+
+
+/** XY-cut of the occupied parts of the island map.
+ *
+ * Each rectangle is cut in two by raster_island_cut() until no cuts are
+ * left.  Horizontal cuts are only kept if one of the halves was cut
+ * further, since blank rows already cost nothing.  Striped pages can be
+ * cut thousands of times deep, so the rectangles waiting for their halves
+ * are kept on a stack of their own rather than by recursion.
+ *
+ * @return The number of regions, or -1 if out of memory.
+ */
+static int
+raster_island_split(
+	const uint8_t * const map,
+	const int tiles,
+	const int height,
+	const int gap,
+	raster_region_t ** const regions,
+	int * const count
+)
+{
+	int * const rows = malloc(height * sizeof(*rows));
+	int * const cols = malloc(tiles * sizeof(*cols));
+	raster_island_frame_t * stack = malloc(sizeof(*stack));
+	int stack_size = 1;
+	int depth = 0;
+	int rc = -1;
+
+	if (!rows || !cols || !stack)
+		goto done;
+
+	stack[depth++] = (raster_island_frame_t) {
+		.r = { 0, tiles, 0, height },
+	};
+
+	while (depth)
+	{
+		raster_island_frame_t * f = &stack[depth - 1];
+		raster_region_t child;
+		bool leaf = false;
+
+		if (f->stage == 0)
+		{
+			f->cut = raster_island_cut(map, tiles, gap, rows, cols, f);
+			f->start = *count;
+			if (f->cut < 0)
+			{
+				depth--;
+				continue;
+			}
+			leaf = f->cut == 0;
+			child = f->a;
+		} else
+		if (f->stage == 1)
+		{
+			child = f->b;
+		} else {
+			// Neither half was cut any further; keep them together
+			leaf = f->cut == 'y' && *count - f->start <= 2;
+			if (leaf)
+				*count = f->start;
+			else
+				depth--;
+		}
+
+		if (leaf)
+		{
+			raster_region_t * const new_regions = realloc(*regions,
+				(*count + 1) * sizeof(**regions));
+			if (!new_regions)
+				goto done;
+
+			*regions = new_regions;
+			new_regions[(*count)++] = (raster_region_t) {
+				.x0 = f->r.x0 * RASTER_ISLAND_TILE,
+				.x1 = f->r.x1 * RASTER_ISLAND_TILE,
+				.y0 = f->r.y0,
+				.y1 = f->r.y1,
+			};
+			depth--;
+			continue;
+		}
+
+		if (f->stage++ > 1)
+			continue;
+
+		if (depth == stack_size)
+		{
+			raster_island_frame_t * const new_stack = realloc(stack,
+				2 * stack_size * sizeof(*stack));
+			if (!new_stack)
+				goto done;
+			stack = new_stack;
+			stack_size *= 2;
+		}
+		stack[depth++] = (raster_island_frame_t) { .r = child };
+	}
+
+	rc = *count;
+
+done:
+	free(rows);
+	free(cols);
+	free(stack);
+	return rc;
+}
+
+
+/**
+ * Split the bitmap into independent islands of marks.
+ *
+ * Every row is converted once to build a map of which tiles are used,
+ * then the map is cut into rectangles and the rectangles are ordered
+ * by a greedy nearest neighbour walk.  Each region is rastered from its
+ * bottom row upwards, so it starts at its lower left corner and ends
+ * on its top row.
+ *
+ * @return The number of regions, or -1 on error.
+ */
+static int
+raster_islands(
+	FILE * const bitmap_file,
+	worker_pool_t * const pool,
+	raster_band_t * const band,
+	const long base_offset,
+	raster_region_t ** const regions_out
+)
+{
+	const int tiles = (band->h + RASTER_ISLAND_TILE - 1) / RASTER_ISLAND_TILE;
+	const raster_region_t page = { 0, band->h, 0, height };
+	raster_region_t * regions = NULL;
+	int count = 0;
+
+	band->map = calloc((size_t) tiles * height, 1);
+	band->tiles = tiles;
+	band->pass = -1;
+	if (!band->map)
+		return -1;
+
+	if (!raster_encode_region(NULL, bitmap_file, pool, band, base_offset, &page))
+		goto fail;
+
+	/* Gaps narrower than this are cheaper to sweep across than to
+	 * start a new block for.
+	 */
+	int gap = RASTER_ISLAND_GAP * resolution / POINTS_PER_INCH;
+	if (raster_mode != 'c' && raster_mode != 'g')
+		gap /= 8;
+	gap /= RASTER_ISLAND_TILE;
+	if (gap < 1)
+		gap = 1;
+
+	if (raster_island_split(band->map, tiles, height, gap,
+		&regions, &count) < 0)
+		goto fail;
+
+	// Greedy ordering, starting from the origin.  Regions are rastered
+	// from the bottom row up, so each is placed by its bottom left
+	// corner, where its scan starts.
+	int cx = 0;
+	int cy = 0;
+	for (int i = 0 ; i < count ; i++)
+	{
+		long best_dist = LONG_MAX;
+		int best = i;
+		for (int j = i ; j < count ; j++)
+		{
+			const long dx = regions[j].x0 - cx;
+			const long dy = regions[j].y1 - cy;
+			const long dist = dx * dx + dy * dy;
+			if (dist < best_dist)
+			{
+				best_dist = dist;
+				best = j;
+			}
+		}
+
+		const raster_region_t t = regions[i];
+		regions[i] = regions[best];
+		regions[best] = t;
+
+		cx = regions[i].x0;
+		cy = regions[i].y1;
+	}
+
+	for (int i = 0 ; i < count ; i++)
+	{
+		if (regions[i].x1 > band->h)
+			regions[i].x1 = band->h;
+		if (debug)
+			printf("Island %d: x=%d-%d y=%d-%d\n",
+				i,
+				regions[i].x0,
+				regions[i].x1,
+				regions[i].y0,
+				regions[i].y1
+			);
+	}
+
+	free(band->map);
+	band->map = NULL;
+	*regions_out = regions;
+	return count;
+
+fail:
+	free(band->map);
+	band->map = NULL;
+	free(regions);
+	return -1;
+}
+
+
+/**
+ * Encode the bitmap as PCL raster rows.
+ *
+ * With raster_islands enabled, the bitmap is split into separate
+ * rectangular regions that are each sent as their own raster block so
+ * that the head does not sweep across the empty space between them.
+ */
+static bool
+generate_raster(pjl_buf_t *job, FILE *bitmap_file)
+{
+    int h;
+    int d;
+    int offx;
+    int offy;
+    int basex = 0;
+    int basey = 0;
+    int repeat;
+    bool rc = false;
+
+    uint8_t bitmap_header[BITMAP_HEADER_NBYTES];
+
+    if (x_center) {
+        basex = x_center - width / 2;
+    }
+    if (y_center) {
+        basey = y_center - height / 2;
+    }
+    if (basex < 0) {
+        basex = 0;
+    }
+    if (basey < 0) {
+        basey = 0;
+    }
+    // rasterises
+    basex = basex * resolution / POINTS_PER_INCH;
+    basey = basey * resolution / POINTS_PER_INCH;
+
+    /* The compression report is for this page only. */
+    memset(&raster_stats, 0, sizeof(raster_stats));
+
+    worker_pool_t * const pool = worker_pool_create(raster_threads);
+    raster_row_t * const rows = calloc(RASTER_BAND_ROWS, sizeof(*rows));
+    raster_region_t * regions = NULL;
+    uint8_t * arena = NULL;
+    raster_band_t band = { .rows = NULL };
+    if (!pool || !rows) {
+        perror("raster buffers");
+        goto fail;
+    }
+
+    repeat = raster_repeat;
+    while (repeat--) {
+        /* repeated (over printed) */
+        int pass;
+        int passes;
+        int nregions;
+        long base_offset;
+        long page_offset = 0;
+        long page_size = 0;
+        if (raster_mode == 'c') {
+            passes = 7;
+        } else {
+            passes = 1;
+        }
+
+        /* Read in the bitmap header; each page is its own BMP.  A
+         * streamed one is read from the start of each page in turn.
+         */
+        if (!raster_stream)
+            page_offset = ftell(bitmap_file);
+        if (fread(bitmap_header, 1, BITMAP_HEADER_NBYTES, bitmap_file)
+            != BITMAP_HEADER_NBYTES) {
+            fprintf(stderr, "Short bitmap header from gs\n");
+            goto fail;
+        }
+
+        /* Re-load width/height from bmp as it is possible that someone used
+         * setpagedevice or some such
+         */
+        /* Bytes 18 - 21 are the bitmap width (little endian format). */
+        width = big_to_little_endian(bitmap_header + 18, 4);
+
+        /* Bytes 22 - 25 are the bitmap height (little endian format). */
+        height = big_to_little_endian(bitmap_header + 22, 4);
+
+        /* Bytes 10 - 13 base offset for the beginning of the bitmap data. */
+        base_offset = page_offset + big_to_little_endian(bitmap_header + 10, 4);
+
+        /* Bytes 2 - 5 are the size of the whole BMP. */
+        page_size = big_to_little_endian(bitmap_header + 2, 4);
+
+        /* A pipe can't seek, so read past the palette to the rows. */
+        if (raster_stream) {
+            long skip = base_offset - BITMAP_HEADER_NBYTES;
+            while (skip > 0 && fgetc(bitmap_file) != EOF)
+                skip--;
+            if (skip != 0 || width <= 0 || height <= 0) {
+                fprintf(stderr, "Bad bitmap header from gs\n");
+                goto fail;
+            }
+        }
+
+        if (raster_mode == 'c') {
+            /* colour is three bytes per pixel */
+            h = width;
+            /* BMP padded to 4 bytes per scan line */
+            d = (h * 3 + 3) / 4 * 4;
+        } else if (raster_mode == 'g') {
+            /* grey is a byte per pixel power level */
+            h = width;
+            d = (h + 3) / 4 * 4;
+        } else if (halftone_mode) {
+            /* mono from a grey bitmap that we halftone */
+            h = (width + 7) / 8;
+            d = (width + 3) / 4 * 4;
+        } else {
+            /* mono */
+            h = (width + 7) / 8;
+            /* BMP padded to 4 bytes per scan line */
+            d = (h + 3) / 4 * 4;
+        }
+        if (debug) {
+            printf("Width %d Height %d Bytes %d Line %d\n",
+                    width, height, h, d);
+        }
+
+        /* Each row owns a slice of the arena for its raw scan line,
+         * its power levels and its worst case packed output.  PackBits
+         * is worst on runs like "aab", which pack 3 bytes into 4; the
+         * output also has 64 bytes in front for the row header and up
+         * to 7 bytes of padding.  Raw rows are never longer.
+         */
+        raster_halftone_free(&band);
+        band = (raster_band_t) {
+            .rows = rows,
+            .h = h,
+            .d = d,
+            .out_size = 64 + h + (h + 2) / 3 + 8,
+            .stream = raster_stream,
+            .mode = (raster_mode == 'c' || raster_mode == 'g') ? 7 : 2,
+        };
+        const size_t row_size = d + h + band.out_size;
+        free(arena);
+        arena = malloc(row_size * RASTER_BAND_ROWS);
+        if (!arena) {
+            perror("raster arena");
+            goto fail;
+        }
+        for (int i = 0; i < RASTER_BAND_ROWS; i++) {
+            rows[i].raw = arena + i * row_size;
+            rows[i].row = rows[i].raw + d;
+            rows[i].out = rows[i].row + h;
+        }
+        if (raster_mode == 'm' && halftone_mode
+        &&  !raster_halftone_init(&band)) {
+            perror("halftone buffers");
+            goto fail;
+        }
+
+        free(regions);
+        regions = NULL;
+        if (raster_island_mode) {
+            nregions = raster_islands(bitmap_file, pool, &band, base_offset, &regions);
+            if (nregions < 0) {
+                fprintf(stderr, "Unable to split raster into islands\n");
+                goto fail;
+            }
+        } else {
+            regions = calloc(1, sizeof(*regions));
+            if (!regions) {
+                perror("raster regions");
+                goto fail;
+            }
+            regions[0] = (raster_region_t) { 0, h, 0, height };
+            nregions = 1;
+        }
+
+        /* Raster Orientation */
+        pjl_printf(job, "\e*r0F");
+        /* Raster power -- color and gray scaled before, but scale with the user provided power */
+        pjl_printf(job, "\e&y%dP", raster_power);
+
+        /* Raster speed */
+        pjl_printf(job, "\e&z%dS", raster_speed);
+        pjl_printf(job, "\e*r%dT", height * y_repeat + raster_crop_y);
+        pjl_printf(job, "\e*r%dS", width * x_repeat + raster_crop_x);
+        /* Raster compression */
+        pjl_printf(job, "\e*b%dM", band.mode);
+        band.wire_mode = band.mode;
+        /* Raster direction (1 = up) */
+        pjl_printf(job, "\e&y1O");
+
+        if (debug) {
+            /* Output raster debug information */
+            printf("Raster power=%d speed=%d\n",
+                    ((raster_mode == 'c' || raster_mode == 'g') ?
+                     100 : raster_power),
+                    raster_speed);
+        }
+
+        /* start at current position */
+        pjl_printf(job, "\e*r1A");
+        for (offx = width * (x_repeat - 1); offx >= 0; offx -= width) {
+            for (offy = height * (y_repeat - 1); offy >= 0; offy -= height) {
+                band.x = basex + offx + raster_crop_x;
+                band.y = basey + offy + raster_crop_y;
+
+                for (int i = 0; i < nregions; i++) {
+                    /* Each island is its own raster block */
+                    if (i != 0) {
+                        pjl_printf(job, "\e*rC");
+                        pjl_printf(job, "\e*r1A");
+                    }
+
+                    for (pass = 0; pass < passes; pass++) {
+                        band.pass = pass;
+                        if (!raster_encode_region(job, bitmap_file,
+                            pool, &band, base_offset, &regions[i]))
+                            goto fail;
+                    }
+                }
+            }
+        }
+        pjl_printf(job, "\e*rC");       // end raster
+        pjl_putc(job, 26);      // some end of file markers
+        pjl_putc(job, 4);
+
+        /* Repeats re-read this page, then move on to the next one. */
+        if (!raster_stream)
+            fseek(bitmap_file, page_offset + (repeat ? 0 : page_size), SEEK_SET);
+    }
+    rc = true;
+
+    for (int i = 0; i < RASTER_COMPRESS_MODES; i++) {
+        if (raster_stats.rows[i])
+            printf("Raster compression %d: %ld rows %ld bytes\n",
+                i, raster_stats.rows[i], raster_stats.bytes[i]);
+    }
+
+fail:
+    raster_halftone_free(&band);
+    free(regions);
+    free(arena);
+    free(rows);
+    worker_pool_destroy(pool);
+    return rc;
+}
+
+
+/** Rotate a bitmap point 90 degrees clockwise if the raster was. */
+static void
+raster_orient_point(
+	int * const x,
+	int * const y
+)
+{
+	if (!raster_rotated_height)
+		return;
+
+	const int t = *x;
+	*x = raster_rotated_height - 1 - *y;
+	*y = t;
+}
+
+
+/** Transpose an 8x8 block of bits, most significant bit first.
+ * Row i of out is column i of in.
+ */
+static void
+transpose_bits8(
+	const uint8_t * const in,
+	const size_t in_stride,
+	uint8_t * const out,
+	const size_t out_stride
+)
+{
+	uint64_t x = 0;
+	for (int i = 0 ; i < 8 ; i++)
+		x = x << 8 | in[i * in_stride];
+
+	uint64_t t;
+	t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+	x = x ^ t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+	x = x ^ t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+	x = x ^ t ^ (t << 28);
+
+	for (int i = 7 ; i >= 0 ; i--, x >>= 8)
+		out[i * out_stride] = x;
+}
+
+
+/** Transpose a 16x16 block of bytes. */
+static void
+transpose_bytes16(
+	const uint8_t * const in,
+	const size_t in_stride,
+	uint8_t * const out,
+	const size_t out_stride
+)
+{
+#ifdef __SSE2__
+	__m128i a[16];
+	__m128i b[16];
+
+	for (int i = 0 ; i < 16 ; i++)
+		a[i] = _mm_loadu_si128((const void *) &in[i * in_stride]);
+
+	// Each stage interleaves pairs of registers with twice the width
+	// of the stage before, until every register is one column.
+	for (int j = 0 ; j < 8 ; j++)
+	{
+		b[j + 0] = _mm_unpacklo_epi8(a[2 * j], a[2 * j + 1]);
+		b[j + 8] = _mm_unpackhi_epi8(a[2 * j], a[2 * j + 1]);
+	}
+
+	for (int h = 0 ; h < 16 ; h += 8)
+	{
+		for (int m = 0 ; m < 4 ; m++)
+		{
+			a[h + m + 0] = _mm_unpacklo_epi16(b[h + 2 * m], b[h + 2 * m + 1]);
+			a[h + m + 4] = _mm_unpackhi_epi16(b[h + 2 * m], b[h + 2 * m + 1]);
+		}
+	}
+
+	for (int g = 0 ; g < 16 ; g += 4)
+	{
+		for (int n = 0 ; n < 2 ; n++)
+		{
+			b[g + n + 0] = _mm_unpacklo_epi32(a[g + 2 * n], a[g + 2 * n + 1]);
+			b[g + n + 2] = _mm_unpackhi_epi32(a[g + 2 * n], a[g + 2 * n + 1]);
+		}
+	}
+
+	for (int g = 0 ; g < 16 ; g += 4)
+	{
+		a[g + 0] = _mm_unpacklo_epi64(b[g + 0], b[g + 1]);
+		a[g + 1] = _mm_unpackhi_epi64(b[g + 0], b[g + 1]);
+		a[g + 2] = _mm_unpacklo_epi64(b[g + 2], b[g + 3]);
+		a[g + 3] = _mm_unpackhi_epi64(b[g + 2], b[g + 3]);
+	}
+
+	for (int i = 0 ; i < 16 ; i++)
+		_mm_storeu_si128((void *) &out[i * out_stride], a[i]);
+#else
+	for (int i = 0 ; i < 16 ; i++)
+		for (int j = 0 ; j < 16 ; j++)
+			out[j * out_stride + i] = in[i * in_stride + j];
+#endif
+}
+
+
+/**
+ * Transpose a bitmap held in memory, tile by tile so that both the
+ * rows being read and the rows being written stay in cache.
+ *
+ * @param src rows x cols pixels, each row src_stride bytes
+ * @param dst cols x rows pixels, each row dst_stride bytes, zeroed
+ * @param bits 1 for packed mono, 8 for grey
+ *
+ * Mono rows and columns must be padded to multiples of 8 and grey
+ * ones to multiples of 16 in both buffers.
+ */
+static void
+raster_transpose(
+	const uint8_t * const src,
+	const size_t src_stride,
+	uint8_t * const dst,
+	const size_t dst_stride,
+	const int rows,
+	const int cols,
+	const int bits
+)
+{
+	const int step = bits == 1 ? 8 : 16;
+
+	for (int r0 = 0 ; r0 < rows ; r0 += ROTATE_BLOCK)
+	{
+		const int r1 = r0 + ROTATE_BLOCK < rows ? r0 + ROTATE_BLOCK : rows;
+		for (int c0 = 0 ; c0 < cols ; c0 += ROTATE_BLOCK)
+		{
+			const int c1 = c0 + ROTATE_BLOCK < cols ? c0 + ROTATE_BLOCK : cols;
+			for (int r = r0 ; r < r1 ; r += step)
+			{
+				for (int c = c0 ; c < c1 ; c += step)
+				{
+					if (bits == 1)
+						transpose_bits8(
+							&src[r * src_stride + c / 8], src_stride,
+							&dst[c * dst_stride + r / 8], dst_stride);
+					else
+						transpose_bytes16(
+							&src[r * src_stride + c], src_stride,
+							&dst[c * dst_stride + r], dst_stride);
+				}
+			}
+		}
+	}
+}
+
+
+/** Estimated cost of rastering a set of rows, in pixels of head travel.
+ * Every row with something in it pays for the turnaround as well as
+ * for the sweep across its extent.
+ */
+static long
+raster_scan_cost(
+	const int * const lo,
+	const int * const hi,
+	const int n
+)
+{
+	const long turnaround = RASTER_TURNAROUND * resolution / POINTS_PER_INCH;
+	long cost = 0;
+
+	for (int i = 0 ; i < n ; i++)
+		if (lo[i] <= hi[i])
+			cost += turnaround + hi[i] - lo[i] + 1;
+
+	return cost;
+}
+
+
+/**
+ * Choose the faster scan axis for a mono or grey bitmap.
+ *
+ * The whole bitmap is loaded and the raster time is estimated from the
+ * extent of every row and of every column.  If scanning along the
+ * columns wins (or rotation is forced) the bitmap is rotated 90
+ * degrees clockwise into a new temporary BMP and the vectors will be
+ * rotated to match when they are parsed.
+ *
+ * @return The bitmap file to raster from, at the start of the page.  If
+ * it is not the one passed in, the caller must close it.
+ */
+static FILE *
+raster_orient(
+	FILE * const bitmap_file
+)
+{
+	uint8_t header[BITMAP_HEADER_NBYTES];
+	uint8_t * src = NULL;
+	uint8_t * dst = NULL;
+	int * lo = NULL;
+	int * hi = NULL;
+	FILE * rotated = NULL;
+	char file_basename[FILENAME_NCHARS];
+	char filename_rotated[FILENAME_NCHARS];
+
+	if (!raster_rotate || raster_mode == 'c')
+		return bitmap_file;
+
+	// Each page of a document is its own BMP in the file
+	raster_rotated_height = 0;
+	const long page_offset = ftell(bitmap_file);
+	if (fread(header, 1, sizeof(header), bitmap_file) != sizeof(header))
+		goto keep;
+
+	const int w = big_to_little_endian(header + 18, 4);
+	const int h = big_to_little_endian(header + 22, 4);
+	const long base_offset = page_offset + big_to_little_endian(header + 10, 4);
+	const long page_size = big_to_little_endian(header + 2, 4);
+	const int bits = (raster_mode == 'g' || halftone_mode) ? 8 : 1;
+	const int step = bits == 1 ? 8 : 16;
+
+	// The rotated page has to fit on the bed
+	if ((long) h * POINTS_PER_INCH / resolution > BED_WIDTH
+	||  (long) w * POINTS_PER_INCH / resolution > BED_HEIGHT)
+	{
+		if (debug)
+			printf("Rotated raster does not fit the bed\n");
+		goto keep;
+	}
+
+	/* Both buffers are padded so the transpose only sees whole
+	 * tiles; file row k is image row h-1-k.
+	 */
+	const int rows = (h + step - 1) / step * step;
+	const int cols = (w + step - 1) / step * step;
+	const size_t d = bits == 1 ? ((w + 7) / 8 + 3) / 4 * 4 : (w + 3) / 4 * 4;
+	const size_t src_stride = cols * bits / 8;
+	const size_t dst_stride = rows * bits / 8;
+
+	src = calloc(rows, src_stride);
+	dst = calloc(cols, dst_stride);
+	lo = malloc((w + h) * sizeof(*lo));
+	hi = malloc((w + h) * sizeof(*hi));
+	if (!src || !dst || !lo || !hi)
+	{
+		perror("rotate buffers");
+		goto keep;
+	}
+
+	// Grey padding is white, mono padding is zero
+	if (bits == 8)
+		memset(src + h * src_stride, 255, (rows - h) * src_stride);
+
+	for (int i = 0 ; i < w + h ; i++)
+	{
+		lo[i] = INT_MAX;
+		hi[i] = -1;
+	}
+
+	// Columns are lo/hi[0..w), rows are lo/hi[w..w+h)
+	fseek(bitmap_file, base_offset, SEEK_SET);
+	for (int k = 0 ; k < h ; k++)
+	{
+		uint8_t * const row = &src[k * src_stride];
+		if (fread(row, 1, d < src_stride ? d : src_stride, bitmap_file)
+			!= (d < src_stride ? d : src_stride))
+			goto keep;
+		if (d > src_stride)
+			fseek(bitmap_file, d - src_stride, SEEK_CUR);
+
+		for (int x = 0 ; x < w ; x++)
+		{
+			const int on = bits == 1
+				? row[x / 8] & (0x80 >> (x % 8))
+				: raster_lut[row[x]] != 0 || (halftone_mode && row[x] != 255);
+			if (!on)
+				continue;
+			if (x < lo[k + w]) lo[k + w] = x;
+			if (x > hi[k + w]) hi[k + w] = x;
+			if (k < lo[x]) lo[x] = k;
+			if (k > hi[x]) hi[x] = k;
+		}
+
+		if (bits == 8)
+			memset(row + w, 255, src_stride - w);
+	}
+
+	const long cost_x = raster_scan_cost(lo + w, hi + w, h);
+	const long cost_y = raster_scan_cost(lo, hi, w);
+	if (debug)
+		printf("Raster cost: x=%ld y=%ld\n", cost_x, cost_y);
+
+	if (raster_rotate != 90 && cost_y >= cost_x)
+		goto keep;
+
+	raster_transpose(src, src_stride, dst, dst_stride, rows, cols, bits);
+
+	/* Transposed row x is image column x, read from the bottom up,
+	 * which is rotated image row x.  The BMP is stored bottom up, so
+	 * write them in reverse.
+	 */
+	snprintf(file_basename, sizeof(file_basename), "%s/%s-%d",
+		TMP_DIRECTORY, FILE_BASENAME, getpid());
+	tmp_file_create(filename_rotated, file_basename, ".rot.bmp");
+	rotated = fopen(filename_rotated, "w+");
+	if (!rotated)
+	{
+		perror(filename_rotated);
+		goto keep;
+	}
+
+	const size_t new_d = bits == 1 ? ((h + 7) / 8 + 3) / 4 * 4 : (h + 3) / 4 * 4;
+	const uint32_t new_header[] = {
+		BITMAP_HEADER_NBYTES + new_d * w, // file size (after "BM")
+		0,
+		BITMAP_HEADER_NBYTES, // offset of the bits
+		40, // info header size
+		h, // width
+		w, // height
+	};
+
+	memset(header, 0, sizeof(header));
+	header[0] = 'B';
+	header[1] = 'M';
+	for (unsigned i = 0 ; i < sizeof(new_header) / sizeof(*new_header) ; i++)
+		for (int j = 0 ; j < 4 ; j++)
+			header[2 + i * 4 + j] = new_header[i] >> (8 * j);
+	header[26] = 1; // planes
+	header[28] = bits;
+	fwrite(header, 1, sizeof(header), rotated);
+
+	uint8_t * const pad = calloc(1, new_d);
+	for (int x = w - 1 ; x >= 0 ; x--)
+	{
+		const uint8_t * const row = &dst[x * dst_stride];
+		if (new_d <= dst_stride)
+		{
+			fwrite(row, 1, new_d, rotated);
+		} else {
+			fwrite(row, 1, dst_stride, rotated);
+			fwrite(pad, 1, new_d - dst_stride, rotated);
+		}
+	}
+	free(pad);
+
+	// The open stream keeps the file; the name is no longer needed
+	fflush(rotated);
+	tmp_file_remove(filename_rotated, file_basename, ".rot.bmp");
+
+	if (ferror(rotated))
+	{
+		perror(filename_rotated);
+		fclose(rotated);
+		rotated = NULL;
+		goto keep;
+	}
+
+	printf("Rotating job 90 degrees clockwise (%dx%d -> %dx%d)\n", w, h, h, w);
+	raster_rotated_height = h;
+	rewind(rotated);
+
+	// The next page starts after this one in the original
+	fseek(bitmap_file, page_offset + page_size, SEEK_SET);
+
+keep:
+	free(src);
+	free(dst);
+	free(lo);
+	free(hi);
+	if (rotated)
+		return rotated;
+
+	fseek(bitmap_file, page_offset, SEEK_SET);
+	return bitmap_file;
+}
+
+
+/** SHA-256 state, for the keys of the job cache and the saved tours. */
+typedef struct
+{
+	uint32_t h[8];
+	uint8_t block[64];
+	size_t used;
+	uint64_t bytes;
+} sha256_t;
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+
+static void
+sha256_block(
+	sha256_t * const sha,
+	const uint8_t * const p
+)
+{
+	uint32_t w[64];
+	for (int i = 0 ; i < 16 ; i++)
+		w[i] = (uint32_t) p[4*i] << 24 | p[4*i+1] << 16
+			| p[4*i+2] << 8 | p[4*i+3];
+	for (int i = 16 ; i < 64 ; i++)
+		w[i] = w[i-16] + w[i-7]
+			+ (ROR32(w[i-15], 7) ^ ROR32(w[i-15], 18) ^ (w[i-15] >> 3))
+			+ (ROR32(w[i-2], 17) ^ ROR32(w[i-2], 19) ^ (w[i-2] >> 10));
+
+	uint32_t a = sha->h[0], b = sha->h[1], c = sha->h[2], d = sha->h[3];
+	uint32_t e = sha->h[4], f = sha->h[5], g = sha->h[6], h = sha->h[7];
+
+	for (int i = 0 ; i < 64 ; i++) {
+		const uint32_t t1 = h + sha256_k[i] + w[i]
+			+ (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25))
+			+ ((e & f) ^ (~e & g));
+		const uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22))
+			+ ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	sha->h[0] += a; sha->h[1] += b; sha->h[2] += c; sha->h[3] += d;
+	sha->h[4] += e; sha->h[5] += f; sha->h[6] += g; sha->h[7] += h;
+}
+
+
+static void
+sha256_init(
+	sha256_t * const sha
+)
+{
+	static const uint32_t h[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+	memcpy(sha->h, h, sizeof(h));
+	sha->used = 0;
+	sha->bytes = 0;
+}
+
+
+static void
+sha256_update(
+	sha256_t * const sha,
+	const void * const data,
+	size_t len
+)
+{
+	const uint8_t * p = data;
+	sha->bytes += len;
+
+	while (len) {
+		if (sha->used == 0 && len >= 64) {
+			sha256_block(sha, p);
+			p += 64;
+			len -= 64;
+			continue;
+		}
+
+		size_t n = 64 - sha->used;
+		if (n > len)
+			n = len;
+		memcpy(sha->block + sha->used, p, n);
+		sha->used += n;
+		p += n;
+		len -= n;
+
+		if (sha->used == 64) {
+			sha256_block(sha, sha->block);
+			sha->used = 0;
+		}
+	}
+}
+
+
+/** Finish the hash as 64 hex digits. */
+static void
+sha256_final(
+	sha256_t * const sha,
+	char * const hex
+)
+{
+	const uint64_t bits = sha->bytes * 8;
+	uint8_t pad[72] = { 0x80 };
+	const size_t pad_len = (sha->used < 56 ? 56 : 120) - sha->used;
+	for (int i = 0 ; i < 8 ; i++)
+		pad[pad_len + i] = bits >> (56 - 8 * i);
+	sha256_update(sha, pad, pad_len + 8);
+
+	for (int i = 0 ; i < 8 ; i++)
+		sprintf(hex + 8 * i, "%08x", sha->h[i]);
+}
+
+
+typedef struct _vector vector_t;
+struct _vector
+{
+	vector_t * next;
+	vector_t ** prev;
+	int x1;
+	int y1;
+	int x2;
+	int y2;
+	int p;
+};
+
+
+typedef struct
+{
+	vector_t * vectors;
+	vector_t ** tail;
+
+	/* The segments by their hash while parsing, to find duplicates */
+	vector_t ** index;
+	size_t index_size;
+	size_t count;
+} vectors_t;
+
+
+/**
+ * Hash a segment so that it is the same cut in either direction; the
+ * low bit says which way this one is cut.
+ */
+static uint64_t
+vector_hash(
+	const vector_t * const v
+)
+{
+	const bool reversed = v->x2 < v->x1
+		|| (v->x2 == v->x1 && v->y2 < v->y1);
+	const int coords[4] = {
+		reversed ? v->x2 : v->x1,
+		reversed ? v->y2 : v->y1,
+		reversed ? v->x1 : v->x2,
+		reversed ? v->y1 : v->y2,
+	};
+
+	uint64_t h = 0x9e3779b97f4a7c15ULL;
+	for (int i = 0 ; i < 4 ; i++)
+	{
+		h = (h ^ (uint32_t) coords[i]) * 0xbf58476d1ce4e5b9ULL;
+		h ^= h >> 31;
+	}
+
+	return (h & ~1ULL) | reversed;
+}
+
+
+/** Find a segment already in the pass, cut in either direction. */
+static bool
+vector_index_find(
+	const vectors_t * const vectors,
+	const vector_t * const v
+)
+{
+	if (!vectors->index_size)
+		return false;
+
+	const size_t mask = vectors->index_size - 1;
+	size_t i = (vector_hash(v) >> 1) & mask;
+	for ( ; vectors->index[i] ; i = (i + 1) & mask)
+	{
+		const vector_t * const p = vectors->index[i];
+		if (p->x1 == v->x1 && p->y1 == v->y1
+		&&  p->x2 == v->x2 && p->y2 == v->y2)
+			return true;
+		if (p->x1 == v->x2 && p->y1 == v->y2
+		&&  p->x2 == v->x1 && p->y2 == v->y1)
+			return true;
+	}
+
+	return false;
+}
+
+
+static void
+vector_index_add(
+	vectors_t * const vectors,
+	vector_t * const v
+)
+{
+	if (2 * (vectors->count + 1) > vectors->index_size)
+	{
+		const size_t size = vectors->index_size
+			? 2 * vectors->index_size : 1024;
+		vector_t ** const index = calloc(size, sizeof(*index));
+		if (!index)
+			return;
+
+		for (size_t i = 0 ; i < vectors->index_size ; i++)
+		{
+			vector_t * const p = vectors->index[i];
+			if (!p)
+				continue;
+			size_t j = (vector_hash(p) >> 1) & (size - 1);
+			while (index[j])
+				j = (j + 1) & (size - 1);
+			index[j] = p;
+		}
+
+		free(vectors->index);
+		vectors->index = index;
+		vectors->index_size = size;
+	}
+
+	const size_t mask = vectors->index_size - 1;
+	size_t i = (vector_hash(v) >> 1) & mask;
+	while (vectors->index[i])
+		i = (i + 1) & mask;
+	vectors->index[i] = v;
+	vectors->count++;
+}
+
+
+static void
+vector_stats(
+	vector_t * v
+)
+{
+	int lx = 0;
+	int ly = 0;
+	long cut_len_sum = 0;
+	int cuts = 0;
+
+	long transit_len_sum = 0;
+	int transits = 0;
+
+	while (v)
+	{
+		long t_dx = lx - v->x1;
+		long t_dy = ly - v->y1;
+
+		long transit_len = sqrt(t_dx * t_dx + t_dy * t_dy);
+		if (transit_len != 0)
+		{
+			transits++;
+			transit_len_sum += transit_len;
 
 			if (0)
 			fprintf(stderr, "mov %8u %8u -> %8u %8u\n",
@@ -737,836 +3598,3374 @@ vector_stats(
 			);
 		}
 
-		long c_dx = v->x1 - v->x2;
-		long c_dy = v->y1 - v->y2;
+		long c_dx = v->x1 - v->x2;
+		long c_dy = v->y1 - v->y2;
+
+		long cut_len = sqrt(c_dx*c_dx + c_dy*c_dy);
+		if (cut_len != 0)
+		{
+			cuts++;
+			cut_len_sum += cut_len;
+
+			if (0)
+			fprintf(stderr, "cut %8u %8u -> %8u %8u\n",
+				v->x1, v->y1,
+				v->x2, v->y2
+			);
+		}
+
+		// Advance the point
+		lx = v->x2;
+		ly = v->y2;
+		v = v->next;
+	}
+
+	printf("Cuts: %u len %lu\n", cuts, cut_len_sum);
+	printf("Move: %u len %lu\n", transits, transit_len_sum);
+}
+
+
+static void
+vector_create(
+	vectors_t * const vectors,
+	int power,
+	int x1,
+	int y1,
+	int x2,
+	int y2
+)
+{
+	const vector_t seg = { .x1 = x1, .y1 = y1, .x2 = x2, .y2 = y2 };
+
+	// If vector optimization is turned on, drop duplicates and,
+	// after the first, points
+	if (!vectors->tail)
+		vectors->tail = &vectors->vectors;
+	if (do_vector_optimize && vectors->vectors)
+	{
+		if (x1 == x2
+		&&  y1 == y2)
+			return;
+		if (vector_index_find(vectors, &seg))
+			return;
+	}
+
+	vector_t * const v = calloc(1, sizeof(*v));
+	if (!v)
+		return;
+
+	v->p = power;
+	v->x1 = x1;
+	v->y1 = y1;
+	v->x2 = x2;
+	v->y2 = y2;
+
+	// Append it to the end of the list
+	v->next = NULL;
+	v->prev = vectors->tail;
+	*vectors->tail = v;
+	vectors->tail = &v->next;
+
+	if (do_vector_optimize)
+		vector_index_add(vectors, v);
+}
+
+
+
+/**
+ * Generate a list of vectors.
+ *
+ * The vector format is:
+ * Pp -- Power setting up to 100
+ * Mx,y -- Move (start a line at x,y)
+ * Lx,y -- Line to x,y from the current position
+ * C -- Closing line segment to the starting position
+ * X -- end of file
+ *
+ * Multi segment vectors are split into individual vectors, which are
+ * then passed into the topological sort routine.
+ *
+ * Exact duplictes will be deleted to try to avoid double hits..
+ */
+static vectors_t *
+vectors_parse(
+	FILE * const vector_file
+)
+{
+	vectors_t * const vectors = calloc(VECTOR_PASSES, sizeof(*vectors));
+	int mx = 0, my = 0;
+	int lx = 0, ly = 0;
+	int pass = 0;
+	int power = 100;
+	int count = 0;
+
+	char buf[256];
+
+	while (fgets(buf, sizeof(buf), vector_file))
+	{
+		//fprintf(stderr, "read '%s'\n", buf);
+		const char cmd = buf[0];
+		int x, y;
+
+		switch (cmd)
+		{
+		case 'P':
+		{
+			// note that they will be in bgr order in the file
+			int r, g, b;
+			sscanf(buf+1, ",%d,%d,%d", &b, &g, &r);
+			if (r == 0 && g != 0 && b == 0)
+			{
+				pass = 0;
+				power = g;
+			} else
+			if (r != 0 && g == 0 && b == 0)
+			{
+				pass = 1;
+				power = r;
+			} else
+			if (r == 0 && g == 0 && b != 0)
+			{
+				pass = 2;
+				power = b;
+			} else {
+				fprintf(stderr, "non-red/green/blue vector? %d,%d,%d\n", r, g, b);
+				exit(-1);
+			}
+			break;
+		}
+		case 'M':
+			// Start a new line.
+			// This also implicitly sets the
+			// current laser position
+			sscanf(buf+1, "%d,%d", &mx, &my);
+			raster_orient_point(&mx, &my);
+			lx = mx;
+			ly = my;
+			break;
+		case 'L':
+			// Add a line segment from the current
+			// point to the new point, and update
+			// the current point to the new point.
+			sscanf(buf+1, "%d,%d", &x, &y);
+			raster_orient_point(&x, &y);
+			vector_create(&vectors[pass], power, lx, ly, x, y);
+			count++;
+			lx = x;
+			ly = y;
+			break;
+		case 'C':
+			// Closing segment from the current point
+			// back to the starting point
+			vector_create(&vectors[pass], power, lx, ly, mx, my);
+			lx = mx;
+			lx = my;
+			break;
+		case 'R':
+			// Non-vector marks for the raster pass
+			break;
+		case 'S':
+			// Page size, only used to crop the raster
+			break;
+		case 'X':
+			goto done;
+		default:
+			fprintf(stderr, "Unknown command '%c'", cmd);
+			return NULL;
+		}
+	}
+
+done:
+	printf("read %u segments\n", count);
+	for (int i = 0 ; i < VECTOR_PASSES ; i++)
+	{
+		free(vectors[i].index);
+		vectors[i].index = NULL;
+		vectors[i].index_size = 0;
+
+		printf("Vector pass %d: power=%d speed=%d\n",
+			i,
+			vector_power[i],
+			vector_speed[i]
+		);
+		vector_stats(vectors[i].vectors);
+	}
+
+	return vectors;
+}
+
+
+/** Find the closest vector to a given point and remove it from the list.
+ *
+ * This might reverse a vector if it is closest to draw it in reverse
+ * order.
+ */
+static vector_t *
+vector_find_closest(
+	vector_t * v,
+	const int cx,
+	const int cy
+)
+{
+	long best_dist = LONG_MAX;
+	vector_t * best = NULL;
+	int do_reverse = 0;
+
+	while (v)
+	{
+		long dx1 = cx - v->x1;
+		long dy1 = cy - v->y1;
+		long dist1 = dx1*dx1 + dy1*dy1;
+
+		if (dist1 < best_dist)
+		{
+			best = v;
+			best_dist = dist1;
+			do_reverse = 0;
+		}
+
+		long dx2 = cx - v->x2;
+		long dy2 = cy - v->y2;
+		long dist2 = dx2*dx2 + dy2*dy2;
+		if (dist2 < best_dist)
+		{
+			best = v;
+			best_dist = dist2;
+			do_reverse = 1;
+		}
+
+		v = v->next;
+	}
+
+	if (!best)
+		return NULL;
+
+	// Remove it from the list
+	*best->prev = best->next;
+	if (best->next)
+		best->next->prev = best->prev;
+
+	// If reversing is required, flip the x1/x2 and y1/y2
+	if (do_reverse)
+	{
+		int x1 = best->x1;
+		int y1 = best->y1;
+		best->x1 = best->x2;
+		best->y1 = best->y2;
+		best->x2 = x1;
+		best->y2 = y1;
+	}
+
+	best->next = NULL;
+	best->prev = NULL;
+
+	return best;
+}
+
+
+/**
+ * Order the vectors greedily from a starting point, taking them off the
+ * list, and return the ordered list.
+ *
+ * Simplistic greedy algorithm: look for the closest vector that starts
+ * or ends at the same point as the current point.
+ *
+ * This does not split vectors.
+ */
+static vector_t *
+vector_order_greedy(
+	vectors_t * const vectors,
+	int cx,
+	int cy
+)
+{
+	vector_t * vs = NULL;
+	vector_t * vs_tail = NULL;
+
+	while (vectors->vectors)
+	{
+		vector_t * v = vector_find_closest(vectors->vectors, cx, cy);
+
+		if (!vs)
+		{
+			// Nothing on the list yet
+			vs = vs_tail = v;
+		} else {
+			// Add it to the tail of the list
+			v->next = NULL;
+			v->prev = &vs_tail->next;
+			vs_tail->next = v;
+			vs_tail = v;
+		}
+		
+		// Move the current point to the end of the line segment
+		cx = v->x2;
+		cy = v->y2;
+	}
+
+	return vs;
+}
+
+
+/** Replace the list in the vectors object with an ordered one. */
+static void
+vector_relink(
+	vectors_t * const vectors,
+	vector_t ** const order,
+	const size_t count
+)
+{
+	vectors->vectors = count ? order[0] : NULL;
+
+	for (size_t i = 0 ; i < count ; i++)
+	{
+		order[i]->prev = i ? &order[i-1]->next : &vectors->vectors;
+		order[i]->next = i + 1 < count ? order[i+1] : NULL;
+	}
+}
+
+
+/**
+ * Optimize the cut order to minimize transit time.
+ */
+static int
+vector_optimize(
+	vectors_t * const vectors
+)
+{
+	vector_t * const vs = vector_order_greedy(vectors, 0, 0);
+
+	vector_stats(vs);
+
+	// Now replace the list in the vectors object with this new one
+	vectors->vectors = vs;
+	if (vs)
+		vs->prev = &vectors->vectors;
+
+	return 0;
+}
+
+
+/** The cut order of a pass from an earlier revision of the job. */
+typedef struct
+{
+	uint64_t * hashes;
+	size_t count;
+} vector_tour_t;
+
+
+static long
+vector_dist(
+	const int x1,
+	const int y1,
+	const int x2,
+	const int y2
+)
+{
+	const long dx = x2 - x1;
+	const long dy = y2 - y1;
+	return sqrt(dx*dx + dy*dy);
+}
+
+
+static void
+vector_reverse(
+	vector_t * const v
+)
+{
+	int x1 = v->x1;
+	int y1 = v->y1;
+	v->x1 = v->x2;
+	v->y1 = v->y2;
+	v->x2 = x1;
+	v->y2 = y1;
+}
+
+
+/**
+ * Reorder a pass by the tour of an earlier revision of the job.  The
+ * segments that are still there keep their order and direction.  The
+ * new ones are ordered greedily into connected runs, and each run goes,
+ * forwards or backwards, into the gap of the tour where it adds the
+ * least transit.
+ *
+ * Ordering the new segments is quadratic in their number, and each run
+ * is a scan and a move of the whole order, so the repair is only done
+ * while its worst case, with every new segment a run of its own, costs
+ * less than the greedy ordering of the whole pass it replaces.
+ *
+ * @return false if too little of the tour is left to be worth reusing,
+ * with the vectors untouched.
+ */
+static bool
+vector_optimize_tour(
+	vectors_t * const vectors,
+	const vector_tour_t * const tour
+)
+{
+	size_t count = 0;
+	for (const vector_t * v = vectors->vectors ; v ; v = v->next)
+		count++;
+	if (!count || !tour->count)
+		return false;
+
+	// Index the segments by their hash
+	size_t size = 1;
+	while (size < 2 * count)
+		size <<= 1;
+
+	struct
+	{
+		uint64_t hash;
+		vector_t * v;
+		bool used;
+	} * const table = calloc(size, sizeof(*table));
+	vector_t ** const order = calloc(count, sizeof(*order));
+	vector_t ** const run = calloc(count, sizeof(*run));
+	bool ok = false;
+	if (!table || !order || !run)
+		goto done;
+
+	for (vector_t * v = vectors->vectors ; v ; v = v->next)
+	{
+		const uint64_t hash = vector_hash(v) & ~1ULL;
+		size_t i = (hash >> 1) & (size - 1);
+		while (table[i].v)
+			i = (i + 1) & (size - 1);
+		table[i].hash = hash;
+		table[i].v = v;
+	}
+
+	// Walk the old tour, keeping the segments that are still there
+	size_t kept = 0;
+	for (size_t t = 0 ; t < tour->count ; t++)
+	{
+		const uint64_t hash = tour->hashes[t] & ~1ULL;
+		size_t i = (hash >> 1) & (size - 1);
+		while (table[i].v
+		&& (table[i].hash != hash || table[i].used))
+			i = (i + 1) & (size - 1);
+		if (!table[i].v)
+			continue;
+
+		table[i].used = true;
+		order[kept++] = table[i].v;
+		if ((vector_hash(table[i].v) ^ tour->hashes[t]) & 1)
+			vector_reverse(table[i].v);
+	}
+
+	// Comparisons for the greedy order of the new segments plus the
+	// gap scans of their runs, against the greedy order of them all.
+	const uint64_t fresh = count - kept;
+	const uint64_t repair_work = fresh * fresh / 2 + fresh * count;
+	const uint64_t optimize_work = (uint64_t) count * count / 2;
+
+	if (repair_work > optimize_work)
+	{
+		// Put back the directions that were changed
+		for (size_t t = 0 ; t < tour->count ; t++)
+		{
+			const uint64_t hash = tour->hashes[t] & ~1ULL;
+			size_t i = (hash >> 1) & (size - 1);
+			while (table[i].v && table[i].hash != hash)
+				i = (i + 1) & (size - 1);
+			if (table[i].v && table[i].used)
+			{
+				table[i].used = false;
+				if ((vector_hash(table[i].v) ^ tour->hashes[t]) & 1)
+					vector_reverse(table[i].v);
+			}
+		}
+		printf("Tour: only %zu of %zu segments left, reoptimizing\n",
+			kept, count);
+		goto done;
+	}
+
+	for (size_t i = 0 ; i < kept ; i++)
+	{
+		vector_t * const v = order[i];
+		*v->prev = v->next;
+		if (v->next)
+			v->next->prev = v->prev;
+	}
+
+	// What is left is new; split its greedy order into connected runs
+	vector_t * v = vector_order_greedy(vectors, 0, 0);
+	size_t n = kept;
+	size_t runs = 0;
+
+	while (v)
+	{
+		size_t len = 0;
+		do {
+			run[len++] = v;
+			v = v->next;
+		} while (v && v->x1 == run[len-1]->x2 && v->y1 == run[len-1]->y2);
+
+		const vector_t * const first = run[0];
+		const vector_t * const last = run[len-1];
+		long best_cost = LONG_MAX;
+		size_t best_gap = 0;
+		bool best_reversed = false;
+
+		for (size_t gap = 0 ; gap <= n ; gap++)
+		{
+			const int px = gap ? order[gap-1]->x2 : 0;
+			const int py = gap ? order[gap-1]->y2 : 0;
+			long fwd = vector_dist(px, py, first->x1, first->y1);
+			long rev = vector_dist(px, py, last->x2, last->y2);
+
+			if (gap < n)
+			{
+				const vector_t * const next = order[gap];
+				const long skip = vector_dist(px, py, next->x1, next->y1);
+				fwd += vector_dist(last->x2, last->y2, next->x1, next->y1) - skip;
+				rev += vector_dist(first->x1, first->y1, next->x1, next->y1) - skip;
+			}
+
+			if (fwd < best_cost)
+			{
+				best_cost = fwd;
+				best_gap = gap;
+				best_reversed = false;
+			}
+			if (rev < best_cost)
+			{
+				best_cost = rev;
+				best_gap = gap;
+				best_reversed = true;
+			}
+		}
+
+		memmove(&order[best_gap + len], &order[best_gap],
+			(n - best_gap) * sizeof(*order));
+		for (size_t i = 0 ; i < len ; i++)
+		{
+			if (!best_reversed)
+			{
+				order[best_gap + i] = run[i];
+				continue;
+			}
+			vector_reverse(run[len - 1 - i]);
+			order[best_gap + i] = run[len - 1 - i];
+		}
+
+		n += len;
+		runs++;
+	}
+
+	vector_relink(vectors, order, n);
+	printf("Tour: reused %zu of %zu segments, %zu new in %zu runs\n",
+		kept, count, count - kept, runs);
+	vector_stats(vectors->vectors);
+	ok = true;
+
+done:
+	free(table);
+	free(order);
+	free(run);
+	return ok;
+}
+
+
+/**
+ * Where the tour of this page of the job is kept.  It is looked up by
+ * the user, the input path and the title, but not by the content, since
+ * it is meant for the next revision of the same job.  With a tour the
+ * output also depends on the earlier revisions, not only on the input
+ * and the options.
+ */
+static void
+vector_tour_path(
+	char * const path,
+	const size_t size,
+	const int page
+)
+{
+	sha256_t sha;
+	char key[65];
+
+	sha256_init(&sha);
+	sha256_update(&sha, job_user, strlen(job_user) + 1);
+	sha256_update(&sha, job_input, strlen(job_input) + 1);
+	sha256_update(&sha, job_title, strlen(job_title) + 1);
+	sha256_update(&sha, &page, sizeof(page));
+	sha256_final(&sha, key);
+
+	snprintf(path, size, "%s/%s.tour", cache_dir, key);
+}
+
+
+/**
+ * Read the tours of the passes from an earlier revision of the job.
+ * The file is the version line, then for each pass its number and
+ * length and the hashes of its segments in order, one per line.
+ */
+static bool
+vector_tour_load(
+	const char * const path,
+	vector_tour_t * const tours
+)
+{
+	FILE * const file = fopen(path, "r");
+	char line[128];
+	if (!file)
+		return false;
+
+	bool ok = fgets(line, sizeof(line), file)
+		&& strcmp(line, VECTOR_TOUR_VERSION "\n") == 0;
+
+	for (int i = 0 ; ok && i < VECTOR_PASSES ; i++)
+	{
+		int pass;
+		size_t count;
+		ok = fgets(line, sizeof(line), file)
+			&& sscanf(line, "pass %d %zu", &pass, &count) == 2
+			&& pass == i;
+		if (!ok)
+			break;
+
+		tours[i].hashes = malloc((count ? count : 1) * sizeof(uint64_t));
+		ok = tours[i].hashes != NULL;
+		for (size_t j = 0 ; ok && j < count ; j++)
+		{
+			ok = fgets(line, sizeof(line), file) != NULL;
+			if (ok)
+				tours[i].hashes[j] = strtoull(line, NULL, 16);
+		}
+		tours[i].count = ok ? count : 0;
+	}
+
+	fclose(file);
+	if (!ok)
+		fprintf(stderr, "%s: unable to read the tour\n", path);
+	return ok;
+}
+
+
+/** Save the tours of the passes for the next revision of the job. */
+static void
+vector_tour_save(
+	const char * const path,
+	const vectors_t * const vectors
+)
+{
+	char tmp[PATH_MAX + 32];
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int) getpid());
+
+	FILE * const file = fopen(tmp, "w");
+	if (!file)
+	{
+		perror(tmp);
+		return;
+	}
+
+	fputs(VECTOR_TOUR_VERSION "\n", file);
+	for (int i = 0 ; i < VECTOR_PASSES ; i++)
+	{
+		size_t count = 0;
+		for (const vector_t * v = vectors[i].vectors ; v ; v = v->next)
+			count++;
+
+		fprintf(file, "pass %d %zu\n", i, count);
+		for (const vector_t * v = vectors[i].vectors ; v ; v = v->next)
+			fprintf(file, "%016" PRIx64 "\n", vector_hash(v));
+	}
+
+	const bool failed = ferror(file);
+	if (fclose(file) || failed || rename(tmp, path) < 0)
+	{
+		perror(tmp);
+		unlink(tmp);
+	}
+}
+
+
+/** Output a pass and return an estimate of its machine time. */
+static double
+output_vector(
+	pjl_buf_t * const job,
+	const vector_t * v,
+	const int speed
+)
+{
+	int lx = 0;
+	int ly = 0;
+	double cut_len = 0;
+	double transit_len = 0;
+
+	while (v)
+	{
+		cut_len += hypot(v->x2 - v->x1, v->y2 - v->y1);
+		transit_len += hypot(v->x1 - lx, v->y1 - ly);
+
+		if (v->x1 != lx || v->y1 != ly)
+		{
+			// Stop the laser; we need to transit
+			// and then start the laser as we go to
+			// the next point.  Note initial ";"
+			pjl_cmd(job, ";PU", v->y1, ",");
+			pjl_int(job, v->x1);
+			pjl_cmd(job, ";PD", v->y2, ",");
+			pjl_int(job, v->x2);
+		} else {
+			// This is the continuation of a line, so
+			// just add additional points
+			pjl_cmd(job, ",", v->y2, ",");
+			pjl_int(job, v->x2);
+		}
+
+		// Changing power on the fly is not supported for now
+		// \todo: Check v->power and adjust ZS, XR, etc
+
+		// Move to the next vector, updating our current point
+		lx = v->x2;
+		ly = v->y2;
+		v = v->next;
+	}
+
+	// Stop the laser (note initial ";")
+	pjl_puts(job, ";PU;");
+
+	return laser_cut_time(cut_len / resolution, speed)
+		+ laser_transit_time(transit_len / resolution);
+}
+
+				
+static bool
+generate_vector(
+	pjl_buf_t * const job,
+	FILE * const vector_file
+)
+{
+	vectors_t * const vectors = vectors_parse(vector_file);
+	const int page = vector_pages++;
+
+	/* With a cache, the tour of the last revision of this page is
+	 * repaired instead of optimizing the whole page again.
+	 */
+	char tour_path[PATH_MAX];
+	vector_tour_t tours[VECTOR_PASSES] = { { NULL, 0 } };
+	const bool tour_saved = cache_dir && do_vector_optimize;
+	if (tour_saved)
+	{
+		vector_tour_path(tour_path, sizeof(tour_path), page);
+		vector_tour_load(tour_path, tours);
+	}
+
+	pjl_printf(job, "IN;");
+	pjl_printf(job, "XR%04d;", vector_freq);
+
+	// \note: step and repeat is no longer supported
+
+	for (int i = 0 ; i < VECTOR_PASSES ; i++)
+	{
+		if (do_vector_optimize
+		&&  !vector_optimize_tour(&vectors[i], &tours[i]))
+			vector_optimize(&vectors[i]);
+		free(tours[i].hashes);
+
+		const vector_t * v = vectors[i].vectors;
+
+		pjl_printf(job, "YP%03d;", vector_power[i]);
+		pjl_printf(job, "ZS%03d", vector_speed[i]); // note: no ";"
+		page_time_vector += output_vector(job, v, vector_speed[i]);
+	}
+
+	if (tour_saved)
+		vector_tour_save(tour_path, vectors);
+
+	pjl_printf(job, "\e%%0B"); // end HLGL
+	pjl_printf(job, "\e%%1BPU"); // start HLGL, pen up?
+
+	return true;
+}
+
+
+/** A vector section built on its own thread while the raster is encoded. */
+typedef struct
+{
+	pthread_t thread;
+	FILE * vector_file;
+	pjl_buf_t out;
+	bool ok;
+} vector_job_t;
+
+
+static void *
+vector_job_thread(
+	void * const arg
+)
+{
+	vector_job_t * const job = arg;
+	job->ok = generate_vector(&job->out, job->vector_file);
+	return NULL;
+}
+
+
+/**
+ * Move a bitmap file past the BMP of the current page.  A streamed one
+ * can't seek and is read through instead.
+ */
+static bool
+bitmap_skip_page(
+	FILE * const bitmap_file
+)
+{
+	uint8_t header[BITMAP_HEADER_NBYTES];
+	const long page_offset = ftell(bitmap_file);
+	if (fread(header, 1, sizeof(header), bitmap_file) != sizeof(header))
+		return false;
+
+	if (raster_stream) {
+		long skip = big_to_little_endian(header + 2, 4) - (long) sizeof(header);
+		while (skip > 0 && fgetc(bitmap_file) != EOF)
+			skip--;
+		return skip <= 0;
+	}
+
+	return fseek(bitmap_file,
+		page_offset + big_to_little_endian(header + 2, 4), SEEK_SET) == 0;
+}
+
+
+/**
+ * Check the vector records of this page for marks that only the raster
+ * pass can make.  With no vector file it is assumed to have some.
+ */
+static bool
+vectors_have_raster(
+	FILE * const vector_file
+)
+{
+	if (!vector_file)
+		return true;
+
+	const long start = ftell(vector_file);
+	char line[256];
+	bool found = false;
+	while (fgets(line, sizeof(line), vector_file)) {
+		if (line[0] == 'X')
+			break;
+		if (line[0] == 'R') {
+			found = true;
+			break;
+		}
+	}
+
+	fseek(vector_file, start, SEEK_SET);
+	return found;
+}
+
+
+/** Count the pages in the vector records, which each end with an X. */
+static int
+vectors_count_pages(
+	FILE * const vector_file
+)
+{
+	char line[256];
+	int pages = 0;
+	while (fgets(line, sizeof(line), vector_file)) {
+		if (line[0] == 'X')
+			pages++;
+	}
+
+	rewind(vector_file);
+	return pages ? pages : 1;
+}
+
+
+/**
+ *
+ */
+static bool
+generate_pjl(FILE *bitmap_file, pjl_buf_t *job,
+                              const char *filename_vector,
+                              FILE *page_vector_file)
+{
+    FILE *vector_file = page_vector_file;
+    vector_job_t vector_job = { .vector_file = NULL };
+    bool vector_thread = false;
+
+    page_time_raster = 0;
+    page_time_vector = 0;
+
+    /* Print the printer job language header. */
+    pjl_job_name(job);
+    pjl_printf(job, "\eE@PJL ENTER LANGUAGE=PCL\r\n");
+    /* Set autofocus on or off. */
+    pjl_printf(job, "\e&y%dA", focus);
+    /* Left (long-edge) offset registration.  Adjusts the position of the
+     * logical page across the width of the page.
+     */
+    pjl_printf(job, "\e&l0U");
+    /* Top (short-edge) offset registration.  Adjusts the position of the
+     * logical page across the length of the page.
+     */
+    pjl_printf(job, "\e&l0Z");
+
+    /* Resolution of the print. */
+    pjl_printf(job, "\e&u%dD", resolution);
+    /* X position = 0 */
+    pjl_printf(job, "\e*p0X");
+    /* Y position = 0 */
+    pjl_printf(job, "\e*p0Y");
+    /* PCL resolution. */
+    pjl_printf(job, "\e*t%dR", resolution);
+
+    /* If raster power is enabled and raster mode is not 'n' then add that
+     * information to the print job.  Only a cropped job trusts the R
+     * records to leave out a page with no raster marks, since a paint
+     * operator the prologue misses would otherwise lose its engraving.
+     * The procedures of a pdf run directly (-N) may have been bound to
+     * the original operators, so their records are not trusted either.
+     */
+    if (raster_power && raster_mode != 'n' && raster_crop && !pdf_input
+    &&  !vectors_have_raster(vector_file)) {
+        printf("Raster skipped: no raster marks on the page\n");
+        /* The next page's bitmap follows this one. */
+        if (bitmap_file)
+            bitmap_skip_page(bitmap_file);
+    } else
+    if (raster_power && raster_mode != 'n') {
+
+        /* FIXME unknown purpose. */
+        pjl_printf(job, "\e&y0C");
+
+        /* We're going to perform a raster print, along whichever
+         * axis is faster.
+         */
+        raster_lut_build();
+        FILE * const raster_file = raster_orient(bitmap_file);
+
+        /* Unless gs is still streaming them, the vector records are
+         * complete and the tour can be optimized while the raster is
+         * encoded into the job.
+         */
+        if (vector_file) {
+            vector_job.vector_file = vector_file;
+            vector_thread = pthread_create(&vector_job.thread, NULL,
+                vector_job_thread, &vector_job) == 0;
+        }
+
+        const bool rastered = generate_raster(job, raster_file);
+        if (raster_file != bitmap_file)
+            fclose(raster_file);
+        if (!rastered) {
+            if (vector_thread) {
+                pthread_join(vector_job.thread, NULL);
+                pjl_free(&vector_job.out);
+            }
+            return false;
+        }
+    }
+
+    if (!vector_file)
+        vector_file = fopen(filename_vector, "r");
+    if (!vector_file) {
+        perror(filename_vector);
+        return false;
+    }
+
+    /* If vector power is > 0 then add vector information to the print job. */
+        pjl_printf(job, "\eE@PJL ENTER LANGUAGE=PCL\r\n");
+        /* Page Orientation */
+        pjl_printf(job, "\e*r0F");
+        pjl_printf(job, "\e*r%dT", height * y_repeat);
+        pjl_printf(job, "\e*r%dS", width * x_repeat);
+        pjl_printf(job, "\e*r1A");
+        pjl_printf(job, "\e*rC");
+        pjl_printf(job, "\e%%1B");
+
+        /* We're going to perform a vector print. */
+        if (vector_thread) {
+            pthread_join(vector_job.thread, NULL);
+            if (vector_job.ok)
+                pjl_append(job, vector_job.out.data, vector_job.out.len);
+            pjl_free(&vector_job.out);
+            if (!vector_job.ok)
+                return false;
+        } else {
+            generate_vector(job, vector_file);
+        }
+        if (vector_file != page_vector_file)
+            fclose(vector_file);
+
+    /* Footer for printer job language. */
+    /* Reset */
+    pjl_printf(job, "\eE");
+    /* Exit language. */
+    pjl_printf(job, "\e%%-12345X");
+    /* End job. */
+    pjl_printf(job, "@PJL EOJ \r\n");
+    /* Pad out the remainder of the file with 0 characters. */
+    memset(pjl_reserve(job, 4096), 0, 4096);
+    job->len += 4096;
+    printf("Estimated time: %.1f s (raster %.1f s, vector %.1f s)\n",
+        page_time_raster + page_time_vector,
+        page_time_raster, page_time_vector);
+    return pjl_flush(job);
+}
+
+/**
+ * Write the procedures that capture the red, green and blue strokes as
+ * vector records and, for mono, set up the screen.
+ *
+ * @param eps_file a file handle to write the postscript procedures to.
+ */
+static void
+ps_prologue(FILE *eps_file)
+{
+    fprintf
+        (eps_file,
+		"/=== {(        ) cvs print} def" // print a number
+		"/stroke {"
+			// check for solid red
+			"currentrgbcolor "
+			"0.0 eq "
+			"exch 0.0 eq "
+			"and "
+			"exch 1.0 eq "
+			"and "
+			// check for solid blue
+			"currentrgbcolor "
+			"0.0 eq "
+			"exch 1.0 eq "
+			"and "
+			"exch 0.0 eq "
+			"and "
+			"or "
+			// check for solid blue
+			"currentrgbcolor "
+			"1.0 eq "
+			"exch 0.0 eq "
+			"and "
+			"exch 0.0 eq "
+			"and "
+			"or "
+			"{"
+				// solid red, green or blue
+				"(P)=== "
+				"currentrgbcolor "
+				"(,)=== "
+				"100 mul round cvi === "
+				"(,)=== "
+				"100 mul round cvi === "
+				"(,)=== "
+				"100 mul round cvi = "
+				"flattenpath "
+				"{ "
+					// moveto
+					"transform (M)=== "
+					"round cvi === "
+					"(,)=== "
+					"round cvi ="
+				"}{"
+					// lineto
+					"transform(L)=== "
+					"round cvi === "
+					"(,)=== "
+					"round cvi ="
+				"}{"
+					// curveto (not implemented)
+				"}{"
+					// closepath
+					"(C)="
+				"}"
+				"pathforall newpath"
+			"}"
+			"{"
+				// Default is to just stroke
+				"epilog_mark stroke"
+			"}"
+			"ifelse"
+		"}bind def"
+		// Report anything painted that the raster pass has to engrave
+		"/epilog_mark {"
+			"/epilog_marked where {pop}{"
+				"(R)= userdict /epilog_marked true put"
+			"}ifelse"
+		"}def"
+		"/fill {epilog_mark fill}bind def"
+		"/eofill {epilog_mark eofill}bind def"
+		"/rectfill {epilog_mark rectfill}bind def"
+		"/shfill {epilog_mark shfill}bind def"
+		"/image {epilog_mark image}bind def"
+		"/imagemask {epilog_mark imagemask}bind def"
+		"/colorimage {epilog_mark colorimage}bind def"
+		"/show {epilog_mark show}bind def"
+		"/ashow {epilog_mark ashow}bind def"
+		"/widthshow {epilog_mark widthshow}bind def"
+		"/awidthshow {epilog_mark awidthshow}bind def"
+		"/kshow {epilog_mark kshow}bind def"
+		"/xshow {epilog_mark xshow}bind def"
+		"/yshow {epilog_mark yshow}bind def"
+		"/xyshow {epilog_mark xyshow}bind def"
+		"/glyphshow {epilog_mark glyphshow}bind def"
+		"/cshow {epilog_mark cshow}bind def"
+		"/ufill {epilog_mark ufill}bind def"
+		"/ueofill {epilog_mark ueofill}bind def"
+		"/ustroke {epilog_mark ustroke}bind def"
+		"/rectstroke {epilog_mark rectstroke}bind def"
+		"/showpage {"
+			"(S)=== currentpagedevice /PageSize get aload pop "
+			"exch round cvi === (,)=== round cvi = "
+			"(X)= flush userdict /epilog_marked undef showpage"
+		"}bind def"
+		"\n");
+    if (raster_mode != 'c' && raster_mode != 'g' && !halftone_mode) {
+        if (screen_size == 0) {
+            fprintf(eps_file, "{0.5 ge{1}{0}ifelse}settransfer\n");
+        } else {
+            int s = screen_size;
+            if (resolution >= 600) {
+                // adjust for overprint
+                fprintf(eps_file,
+                        "{dup 0 ne{%d %d div add}if}settransfer\n",
+                        resolution / 600, s);
+            }
+            fprintf(eps_file, "%d 30{%s}setscreen\n", resolution / s,
+                    (screen_size > 0) ? "pop abs 1 exch sub" :
+                    "180 mul cos exch 180 mul cos add 2 div");
+        }
+    }
+}
+
+
+/**
+ * Write a prologue file that gs runs before a pdf, so that the pdf is
+ * rendered and its vectors are captured without converting it to
+ * postscript first.
+ *
+ * @param filename_prologue the filename to write the prologue to.
+ *
+ * @return Return true if the prologue was written, false otherwise.
+ */
+static bool
+pdf_prologue(const char *filename_prologue)
+{
+    FILE * const prologue_file = fopen(filename_prologue, "w");
+    if (!prologue_file) {
+        perror(filename_prologue);
+        return false;
+    }
+
+    fprintf(prologue_file, "%%!PS\n");
+    ps_prologue(prologue_file);
+    fclose(prologue_file);
+    return true;
+}
+
+
+/**
+ * Convert the given postscript file (ps) converting it to an encapsulated
+ * postscript file (eps).
+ *
+ * @param ps_file a file handle pointing to an opened postscript file that
+ * is to be converted.
+ * @param eps_file a file handle pointing to the opened encapsulated
+ * postscript file to store the result.
+ *
+ * @return Return true if the function completes its task, false otherwise.
+ */
+static bool
+ps_to_eps(FILE *ps_file, FILE *eps_file)
+{
+    int xoffset = 0;
+    int yoffset = 0;
+
+    int l;
+    while (fgets((char *)buf, sizeof (buf), ps_file)) {
+        fprintf(eps_file, "%s", (char *)buf);
+        if (*buf != '%') {
+            break;
+        }
+        if (!strncasecmp((char *) buf, "%%PageBoundingBox:", 18)) {
+            int lower_left_x;
+            int lower_left_y;
+            int upper_right_x;
+            int upper_right_y;
+            if (sscanf((char *)buf + 14, "%d %d %d %d",
+                       &lower_left_x,
+                       &lower_left_y,
+                       &upper_right_x,
+                       &upper_right_y) == 4) {
+                xoffset = lower_left_x;
+                yoffset = lower_left_y;
+                width = (upper_right_x - lower_left_x);
+                height = (upper_right_y - lower_left_y);
+                fprintf(eps_file, "/setpagedevice{pop}def\n"); // use bbox
+                if (xoffset || yoffset) {
+                    fprintf(eps_file, "%d %d translate\n", -xoffset, -yoffset);
+                }
+                if (flip) {
+                    fprintf(eps_file, "%d 0 translate -1 1 scale\n", width);
+                }
+            }
+        }
+        if (!strncasecmp((char *) buf, "%!", 2)) {
+            ps_prologue(eps_file);
+        }
+    }
+    while ((l = fread ((char *) buf, 1, sizeof (buf), ps_file)) > 0) {
+        fwrite ((char *) buf, 1, l, eps_file);
+    }
+    return true;
+}
+
+
+
+/**
+ * Perform range validation checks on the major global variables to ensure
+ * their values are sane. If values are outside accepted tolerances then modify
+ * them to be the correct value.
+ *
+ * @return Nothing
+ */
+static void
+range_checks(void)
+{
+    if (raster_power > 100)
+        raster_power = 100;
+    else
+    if (raster_power < 0)
+        raster_power = 0;
+
+    if (raster_speed > 100)
+        raster_speed = 100;
+    else
+    if (raster_speed < 1)
+        raster_speed = 1;
+
+    if (resolution > 1200)
+        resolution = 1200;
+    else
+    if (resolution < 75)
+        resolution = 75;
+
+    if (screen_size < 1)
+        screen_size = 1;
+
+    if (halftone_dot < 1)
+        halftone_dot = 1;
+
+    if (raster_bands < 0)
+        raster_bands = 1;
+
+    /* Streaming reads each row once, in order, so anything that re-reads
+     * or reorders the bitmap has to use a temporary file.
+     */
+    if (raster_stream
+    && (!raster_power || (raster_mode != 'm' && raster_mode != 'g')
+        || raster_island_mode || raster_rotate
+        || raster_repeat != 1 || x_repeat != 1 || y_repeat != 1)) {
+        fprintf(stderr, "Raster streaming disabled for this job\n");
+        raster_stream = 0;
+    }
+
+    /* Cropping moves the raster on the page, which the rotation and
+     * the repeat tiling don't know about.
+     */
+    if (raster_crop && (raster_rotate || x_repeat != 1 || y_repeat != 1)) {
+        fprintf(stderr, "Raster cropping disabled for this job\n");
+        raster_crop = 0;
+    }
+
+    if (vector_freq < 10)
+        vector_freq = 10;
+    else
+    if (vector_freq > 5000)
+        vector_freq = 5000;
+
+	for (int i = 0 ; i < VECTOR_PASSES ; i++)
+	{
+	    if (vector_power[i] > 100)
+		vector_power[i] = 100;
+	    else
+	    if (vector_power[i] < 0)
+		vector_power[i] = 0;
+
+	    if (vector_speed[i] > 100)
+		vector_speed[i] = 100;
+	    else
+	    if (vector_speed[i] < 1)
+		vector_speed[i] = 1;
+	}
+}
+
+/** Seconds since start. */
+static double
+send_time(
+	const struct timespec * const start
+)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec - start->tv_sec
+		+ (now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+
+/**
+ * Start a non-blocking connect to each of the printer's addresses and
+ * keep whichever one completes first.  A stale address, such as an IPv6
+ * one the printer no longer answers on, then costs nothing as long as
+ * another address works.
+ *
+ * @return A connected socket descriptor, or -1 if none connected within
+ * PRINTER_CONNECT_MS.
+ */
+static int
+printer_connect_race(const struct addrinfo *res)
+{
+    struct pollfd fds[16];
+    const struct addrinfo *addrs[16];
+    int nfds = 0;
+    int winner = -1;
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (const struct addrinfo *addr = res; addr && nfds < 16; addr = addr->ai_next) {
+        const int fd = socket(addr->ai_family, addr->ai_socktype,
+                              addr->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+
+        const int sndbuf = PRINTER_SNDBUF_NBYTES;
+        if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf))) {
+            perror("SO_SNDBUF");
+        }
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+            winner = nfds;
+        } else if (errno != EINPROGRESS) {
+            close(fd);
+            continue;
+        }
+
+        fds[nfds] = (struct pollfd) { .fd = fd, .events = POLLOUT };
+        addrs[nfds++] = addr;
+        if (winner >= 0) {
+            break;
+        }
+    }
+
+    while (winner < 0) {
+        int pending = 0;
+        for (int i = 0; i < nfds; i++) {
+            pending += fds[i].fd >= 0;
+        }
+        const int left = PRINTER_CONNECT_MS - (int) (send_time(&start) * 1000);
+        if (!pending || left <= 0
+        || (poll(fds, nfds, left) < 0 && errno != EINTR)) {
+            break;
+        }
+
+        for (int i = 0; i < nfds; i++) {
+            if (fds[i].fd < 0 || !fds[i].revents) {
+                continue;
+            }
+
+            int error = 0;
+            socklen_t len = sizeof(error);
+            getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &error, &len);
+            if (!error) {
+                winner = i;
+                break;
+            }
+
+            close(fds[i].fd);
+            fds[i].fd = -1;
+        }
+    }
+
+    for (int i = 0; i < nfds; i++) {
+        if (i != winner && fds[i].fd >= 0) {
+            close(fds[i].fd);
+        }
+    }
+    if (winner < 0) {
+        return -1;
+    }
+
+    const int fd = fds[winner].fd;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+    char name[NI_MAXHOST] = "?";
+    char port[NI_MAXSERV] = "?";
+    getnameinfo(addrs[winner]->ai_addr, addrs[winner]->ai_addrlen,
+                name, sizeof(name), port, sizeof(port),
+                NI_NUMERICHOST | NI_NUMERICSERV);
+    printf("connect to %s:%s took %.3f s\n", name, port, send_time(&start));
+
+    return fd;
+}
+
+/** A name lookup on a thread of its own, which the caller can give up on. */
+typedef struct
+{
+	char host[HOSTNAME_NCHARS];
+	char service[NI_MAXSERV];
+	struct addrinfo * res;
+	int error;
+	int refs;
+	bool done;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} resolve_t;
+
+
+/** Drop a reference to a lookup; the last one frees it. */
+static void
+resolve_put(
+	resolve_t * const r
+)
+{
+	pthread_mutex_lock(&r->lock);
+	const int refs = --r->refs;
+	pthread_mutex_unlock(&r->lock);
+	if (refs)
+		return;
+
+	if (r->res)
+		freeaddrinfo(r->res);
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->cond);
+	free(r);
+}
+
+
+static void *
+resolve_thread(
+	void * const arg
+)
+{
+	resolve_t * const r = arg;
+	const struct addrinfo base = {
+		.ai_family = PF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo * res = NULL;
+	const int error = getaddrinfo(r->host, r->service, &base, &res);
+
+	pthread_mutex_lock(&r->lock);
+	r->res = res;
+	r->error = error;
+	r->done = true;
+	pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+
+	resolve_put(r);
+	return NULL;
+}
+
+
+/**
+ * Look up a printer's addresses, giving up after timeout seconds.  The
+ * resolver can't be interrupted, and an alarm would go off in whichever
+ * thread of the spooler it liked, so the lookup runs on a thread of its
+ * own that is left to finish by itself if it is too slow.
+ *
+ * @return 0 with the addresses in res, or a getaddrinfo error code.
+ */
+static int
+printer_resolve(
+	const char * const host,
+	const char * const service,
+	struct addrinfo ** const res,
+	const int timeout
+)
+{
+	resolve_t * const r = calloc(1, sizeof(*r));
+	if (!r)
+		return EAI_MEMORY;
+
+	snprintf(r->host, sizeof(r->host), "%s", host);
+	snprintf(r->service, sizeof(r->service), "%s", service);
+	r->refs = 2;
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, resolve_thread, r) != 0) {
+		r->refs = 1;
+		resolve_put(r);
+		return EAI_AGAIN;
+	}
+	pthread_detach(thread);
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout;
+
+	pthread_mutex_lock(&r->lock);
+	while (!r->done)
+		if (pthread_cond_timedwait(&r->cond, &r->lock, &deadline) == ETIMEDOUT)
+			break;
+
+	const int error = r->done ? r->error : EAI_AGAIN;
+	if (!error) {
+		*res = r->res;
+		r->res = NULL;
+	}
+	pthread_mutex_unlock(&r->lock);
+
+	resolve_put(r);
+	return error;
+}
+
+
+/**
+ * Split a printer's "host:port" or "[v6 address]:port" into the name to
+ * look up and the service to connect to, which is the LPD port unless
+ * one is given.
+ *
+ * @return The service, which may point into host.
+ */
+static const char *
+printer_host_port(
+	const char * const host,
+	char * const name,
+	const size_t size
+)
+{
+	const char * start = host;
+	const char * port = NULL;
+	size_t len = strlen(host);
+
+	if (host[0] == '[') {
+		const char * const end = strchr(host, ']');
+		if (end) {
+			if (end[1] == ':')
+				port = end + 2;
+			start = host + 1;
+			len = end - start;
+		}
+	} else {
+		// A bare v6 address has more than one colon
+		const char * const colon = strchr(host, ':');
+		if (colon && !strchr(colon + 1, ':')) {
+			port = colon + 1;
+			len = colon - host;
+		}
+	}
+
+	if (len >= size)
+		len = size - 1;
+	memcpy(name, start, len);
+	name[len] = '\0';
+
+	return port && *port ? port : "printer";
+}
+
+
+/**
+ * Connect to a printer.
+ *
+ * @param host The hostname or IP address of the printer to connect to,
+ * with an optional ":port".
+ * @param timeout The number of seconds to wait before timing out on the
+ * connect operation.
+ * @return A socket descriptor to the printer.
+ */
+static int
+printer_connect(const char *host, const int timeout)
+{
+    struct addrinfo *res = NULL;
+    struct timespec start;
+    int socket_descriptor = -1;
+    int delay = PRINTER_BACKOFF_MS;
+    int attempt;
+    char name[HOSTNAME_NCHARS];
+    const char * const service = printer_host_port(host, name, sizeof(name));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (attempt = 1; ; attempt++) {
+        /* The addresses are looked up once and reused between attempts,
+         * unless the lookup itself failed.  Give up on the lookup if
+         * the resolver has gone out to lunch.
+         */
+        if (!res) {
+            const int error_code = printer_resolve(name, service, &res,
+                SECONDS_PER_MIN);
+            if (error_code) {
+                fprintf(stderr, "%s: %s\n", host, gai_strerror(error_code));
+                res = NULL;
+            }
+        }
+
+        if (res) {
+            socket_descriptor = printer_connect_race(res);
+        }
+        if (socket_descriptor >= 0) {
+            break;
+        }
+
+        /* Back off exponentially, with jitter so that several jobs
+         * waiting on a rebooting printer don't all retry together.
+         */
+        if (send_time(&start) + delay / 1000.0 > timeout) {
+            break;
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        const int jitter = now.tv_nsec % (delay / 2 + 1);
+        usleep((delay / 2 + jitter) * 1000);
+        if (delay < PRINTER_BACKOFF_MAX_MS) {
+            delay *= 2;
+        }
+    }
+
+    if (res) {
+        freeaddrinfo(res);
+    }
+    if (socket_descriptor < 0) {
+        fprintf(stderr, "Cannot connect to %s\n", host);
+        return -1;
+    }
+
+    printf("connected to %s in %.3f s after %d attempt%s\n",
+        host, send_time(&start), attempt, attempt == 1 ? "" : "s");
+
+    /* Return the newly opened socket descriptor */
+    return socket_descriptor;
+}
+
+/**
+ * Disconnect from a printer.
+ *
+ * @param socket_descriptor the descriptor of the printer that is to be
+ * disconnected from.
+ * @return True if the printer connection was successfully closed, false otherwise.
+ */
+static bool
+printer_disconnect(int socket_descriptor)
+{
+    int error_code;
+    error_code = close(socket_descriptor);
+    /* Report on possible errors to standard error. */
+    if (error_code == -1) {
+        switch (errno) {
+        case EBADF:
+            perror("Socket descriptor given was not valid.");
+            break;
+        case EINTR:
+            perror("Closing socket descriptor was interrupted by a signal.");
+            break;
+        case EIO:
+            perror("I/O error occurred during closing of socket descriptor.");
+            break;
+        }
+    }
+
+    /* Return status of disconnect operation to the calling function. */
+    if (error_code) {
+        return false;
+    } else {
+        return true;
+    }
+}
+
+/**
+ * Open an LPD job on the printer for a data file of job_size bytes.
+ *
+ * The job and user names each become a line of the control file, so a
+ * name with a line break in it, or one too long for the control file,
+ * is refused rather than sent.
+ *
+ * @return A socket descriptor ready for the job data, or -1 on failure.
+ */
+static int
+printer_open(const char *host, const size_t job_size,
+             const char *name, const char *user)
+{
+    char control[4 * HOSTNAME_NCHARS + 1024];
+    char buf[2 * HOSTNAME_NCHARS + 64];
+    char localhost[HOSTNAME_NCHARS] = "";
+    unsigned char lpdres;
+    int socket_descriptor = -1;
+    int len;
+
+    gethostname(localhost, sizeof(localhost));
+    {
+        char *d = strchr(localhost, '.');
+        if (d) {
+            *d = 0;
+        }
+    }
+
+    if (strpbrk(name, "\r\n") || strpbrk(user, "\r\n")) {
+        fprintf(stderr, "Job and user names can't have line breaks\n");
+        return -1;
+    }
+    if (strlen(name) >= HOSTNAME_NCHARS || strlen(user) >= HOSTNAME_NCHARS
+    ||  strlen(queue) >= HOSTNAME_NCHARS) {
+        fprintf(stderr, "Job '%.32s...' has a name that is too long\n", name);
+        return -1;
+    }
+
+    /* The control file, which is sent with its trailing nul */
+    len = snprintf(control, sizeof(control),
+        "H%s\nP%s\nJ%s\nldfA%s%s\nUdfA%s%s\nN%s\n",
+        localhost, user, name, name, localhost, name, localhost, name);
+    if (len < 0 || (size_t) len >= sizeof(control)) {
+        fprintf(stderr, "Control file for job '%.32s...' is too long\n", name);
+        return -1;
+    }
+    const size_t control_len = len;
+
+	if (debug)
+		printf("printer host: '%s'\n", host);
+
+    /* Connect to the printer. */
+    socket_descriptor = printer_connect(host, PRINTER_MAX_WAIT);
+    if (socket_descriptor < 0) {
+        return -1;
+    }
+
+	if (debug)
+		printf("printer host: '%s' fd %d\n", host, socket_descriptor);
+
+    /* Every line below fits buf, since the names were checked above. */
+    // talk to printer
+    len = snprintf(buf, sizeof(buf), "\002%s\n", queue);
+    write(socket_descriptor, buf, len);
+    read(socket_descriptor, &lpdres, 1);
+    if (lpdres) {
+        fprintf (stderr, "Bad response from %s, %u\n", host, lpdres);
+        goto fail;
+    }
+    len = snprintf(buf, sizeof(buf), "\002%zu cfA%s%s\n",
+        control_len, name, localhost);
+    write(socket_descriptor, buf, len);
+
+    read(socket_descriptor, &lpdres, 1);
+    if (lpdres) {
+        fprintf(stderr, "Bad response from %s, %u\n", host, lpdres);
+        goto fail;
+    }
+    write(socket_descriptor, control, control_len + 1);
+    read(socket_descriptor, &lpdres, 1);
+    if (lpdres) {
+        fprintf(stderr, "Bad response from %s, %u\n", host, lpdres);
+        goto fail;
+    }
+
+    len = snprintf(buf, sizeof(buf), "\003%zu dfA%s%s\n",
+        job_size, name, localhost);
+	printf("job '%s': size %zu\n", name, job_size);
+    write(socket_descriptor, buf, len);
+    read(socket_descriptor, &lpdres, 1);
+    if (lpdres) {
+        fprintf(stderr, "Bad response from %s, %u\n", host, lpdres);
+        goto fail;
+    }
+    return socket_descriptor;
+
+fail:
+    printer_disconnect(socket_descriptor);
+    return -1;
+}
+
+/** Throughput of the job data sent to the printer. */
+typedef struct
+{
+	struct timespec start;
+	size_t bytes;
+	unsigned stalls;
+	double stall_time;
+} send_stats_t;
+
+
+/** Account for one send call, which may have been a stall. */
+static void
+send_stats_add(
+	send_stats_t * const stats,
+	const struct timespec * const call_start,
+	const size_t bytes
+)
+{
+	const double dt = send_time(call_start);
+	stats->bytes += bytes;
+	if (dt > PRINTER_STALL_TIME) {
+		stats->stalls++;
+		stats->stall_time += dt;
+	}
+}
+
+
+static void
+send_stats_print(
+	const send_stats_t * const stats,
+	const char * const name
+)
+{
+	const double dt = send_time(&stats->start);
+	printf("job '%s': sent %zu bytes in %.3f s, %.0f bytes/s, "
+		"%u stalls for %.3f s\n",
+		name,
+		stats->bytes,
+		dt,
+		dt > 0 ? stats->bytes / dt : 0,
+		stats->stalls,
+		stats->stall_time);
+}
+
+
+/** Write all of a buffer to the printer, resuming short writes. */
+static bool
+send_all(
+	const int fd,
+	const void * const data,
+	const size_t len,
+	send_stats_t * const stats
+)
+{
+	const uint8_t * p = data;
+	size_t remaining = len;
+
+	while (remaining) {
+		struct timespec call_start;
+		clock_gettime(CLOCK_MONOTONIC, &call_start);
+		const ssize_t rc = write(fd, p, remaining);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("printer write");
+			return false;
+		}
+		send_stats_add(stats, &call_start, rc);
+		p += rc;
+		remaining -= rc;
+	}
+
+	return true;
+}
 
-		long cut_len = sqrt(c_dx*c_dx + c_dy*c_dy);
-		if (cut_len != 0)
-		{
-			cuts++;
-			cut_len_sum += cut_len;
 
-			if (0)
-			fprintf(stderr, "cut %8u %8u -> %8u %8u\n",
-				v->x1, v->y1,
-				v->x2, v->y2
-			);
+/**
+ *
+ */
+static bool
+printer_send(const char *host, const pjl_buf_t *job,
+             const char *name, const char *user)
+{
+    const int socket_descriptor = printer_open(host, job->len, name, user);
+    if (socket_descriptor < 0) {
+        return false;
+    }
+
+    send_stats_t stats = { .bytes = 0 };
+    clock_gettime(CLOCK_MONOTONIC, &stats.start);
+    const bool ok = send_all(socket_descriptor, job->data, job->len, &stats);
+    send_stats_print(&stats, name);
+
+    // dont wait for a response...
+    printer_disconnect(socket_descriptor);
+    return ok;
+}
+
+
+/** A job being written straight into an open LPD data file. */
+typedef struct
+{
+	int fd;
+	size_t size;
+	size_t sent;
+	bool overflow;
+	const bool * abort;
+	send_stats_t stats;
+} lpd_stream_t;
+
+
+static ssize_t
+lpd_stream_write(
+	void * const cookie,
+	const char * buf,
+	size_t len
+)
+{
+	lpd_stream_t * const stream = cookie;
+
+	/* An aborted job is dropped, so what is left isn't sent. */
+	if (*stream->abort)
+		return len;
+
+	/* The printer stops reading at the declared size. */
+	if (stream->sent + len > stream->size) {
+		stream->overflow = true;
+		return 0;
+	}
+
+	if (!send_all(stream->fd, buf, len, &stream->stats))
+		return 0;
+
+	stream->sent += len;
+	return len;
+}
+
+
+static int
+lpd_stream_close(
+	void * const cookie
+)
+{
+	lpd_stream_t * const stream = cookie;
+	static const char zeros[4096];
+	int rc = 0;
+
+	/* Pad the job out to a size that was given on the command line, as
+	 * the footer does with its 4096 nuls.  A job that failed part way
+	 * is not padded; the connection is reset instead, so that the
+	 * printer discards the short data file rather than printing it.
+	 */
+	if (*stream->abort) {
+		const struct linger reset = { .l_onoff = 1, .l_linger = 0 };
+		setsockopt(stream->fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+		fprintf(stderr, "job '%s': aborted after %zu of %zu bytes\n",
+			job_name, stream->sent, stream->size);
+		rc = -1;
+	} else
+	if (stream->overflow) {
+		fprintf(stderr, "Job is larger than the %zu bytes declared; "
+			"give a larger size with --lpd-stream\n", stream->size);
+		rc = -1;
+	} else
+	if (stream->sent < stream->size) {
+		printf("job '%s': padding %zu bytes\n",
+			job_name, stream->size - stream->sent);
+		while (stream->sent < stream->size) {
+			size_t len = stream->size - stream->sent;
+			if (len > sizeof(zeros))
+				len = sizeof(zeros);
+			if (lpd_stream_write(stream, zeros, len) != (ssize_t) len) {
+				rc = -1;
+				break;
+			}
 		}
+	}
 
-		// Advance the point
-		lx = v->x2;
-		ly = v->y2;
-		v = v->next;
+	send_stats_print(&stream->stats, job_name);
+	printer_disconnect(stream->fd);
+	free(stream);
+	return rc;
+}
+
+
+/**
+ * Open a job on the printer that is written as it is generated, like
+ * live-laser does.  LPD needs the size of the data file up front, so a
+ * job shorter than the size declared is padded with nuls by
+ * lpd_stream_close().
+ *
+ * @param abort is checked when the file is closed; if it is set the job
+ * is dropped instead of padded.
+ *
+ * @return A file handle for the job, which must be closed with fclose.
+ */
+static FILE *
+lpd_stream_open(
+	const char * const host,
+	const size_t size,
+	const bool * const abort
+)
+{
+	lpd_stream_t * const stream = calloc(1, sizeof(*stream));
+	if (!stream)
+		return NULL;
+
+	stream->size = size;
+	stream->abort = abort;
+	stream->fd = printer_open(host, size, job_name, job_user);
+	if (stream->fd < 0) {
+		free(stream);
+		return NULL;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stream->stats.start);
+
+	const cookie_io_functions_t io = {
+		.write = lpd_stream_write,
+		.close = lpd_stream_close,
+	};
+	FILE * const file = fopencookie(stream, "w", io);
+	if (!file) {
+		printer_disconnect(stream->fd);
+		free(stream);
+		return NULL;
 	}
 
-	printf("Cuts: %u len %lu\n", cuts, cut_len_sum);
-	printf("Move: %u len %lu\n", transits, transit_len_sum);
+	setvbuf(file, NULL, _IOFBF, 64 << 10);
+	return file;
 }
 
 
+/**
+ * Create an intermediate file.  If the system has anonymous in-memory
+ * files it is one of those, reached through /proc/self/fd so that gs and
+ * the shell can open it by name; otherwise it is a file in TMP_DIRECTORY.
+ *
+ * @param filename set to the name to open the intermediate file by.
+ * @param file_basename the name on disk without the suffix.
+ * @param suffix the suffix for this kind of intermediate file.
+ */
 static void
-vector_create(
-	vectors_t * const vectors,
-	int power,
-	int x1,
-	int y1,
-	int x2,
-	int y2
+tmp_file_create(
+	char * const filename,
+	const char * const file_basename,
+	const char * const suffix
 )
 {
-	// Find the end of the list and, if vector optimization is
-	// turned on, check for duplicates
-	vector_t ** iter = &vectors->vectors;
-	while (*iter)
-	{
-		vector_t * const p = *iter;
+#ifdef MFD_CLOEXEC
+	char name[FILENAME_NCHARS];
+	snprintf(name, sizeof(name), "%s%s", FILE_BASENAME, suffix);
+
+	const int fd = memfd_create(name, 0);
+	if (fd >= 0) {
+		snprintf(filename, FILENAME_NCHARS, "/proc/self/fd/%d", fd);
+		if (access(filename, R_OK | W_OK) == 0)
+			return;
+		close(fd);
+	}
+#endif
+	if (snprintf(filename, FILENAME_NCHARS, "%s%s", file_basename, suffix)
+	>= FILENAME_NCHARS)
+		fprintf(stderr, "%s%s: name too long\n", file_basename, suffix);
+}
 
-		if (do_vector_optimize)
-		{
-			if (p->x1 == x1 && p->y1 == y1
-			&&  p->x2 == x2 && p->y2 == y2)
-				return;
-			if (p->x1 == x2 && p->y1 == y2
-			&&  p->x2 == x1 && p->y2 == y1)
-				return;
-			if (x1 == x2
-			&&  y1 == y2)
-				return;
+
+/**
+ * Remove an intermediate file.  In debug mode a file on disk is kept and
+ * an in-memory file is copied to the name it would have had on disk.
+ */
+static void
+tmp_file_remove(
+	const char * const filename,
+	const char * const file_basename,
+	const char * const suffix
+)
+{
+	int fd;
+	if (sscanf(filename, "/proc/self/fd/%d", &fd) != 1) {
+		if (!debug && unlink(filename))
+			perror(filename);
+		return;
+	}
+
+	if (debug) {
+		char disk_name[FILENAME_NCHARS];
+		char copy[8192];
+		size_t l;
+		snprintf(disk_name, sizeof(disk_name), "%s%s", file_basename, suffix);
+
+		FILE * const in = fopen(filename, "r");
+		FILE * const out = fopen(disk_name, "w");
+		if (in && out) {
+			while ((l = fread(copy, 1, sizeof(copy), in)) > 0)
+				fwrite(copy, 1, l, out);
+		} else {
+			perror(disk_name);
 		}
+		if (in)
+			fclose(in);
+		if (out)
+			fclose(out);
+	}
+
+	close(fd);
+}
+
 
-		iter = &p->next;
+/** A page job being sent to the printer on its own thread. */
+typedef struct
+{
+	pthread_t thread;
+	const char * host;
+	const char * file_basename;
+	char suffix[32];
+	pjl_buf_t job;
+	bool ok;
+} page_send_t;
+
+
+static void *
+page_send_thread(
+	void * const arg
+)
+{
+	page_send_t * const send = arg;
+
+	/* Debug mode keeps a copy of the job on disk. */
+	if (debug) {
+		char filename[FILENAME_NCHARS];
+		snprintf(filename, sizeof(filename), "%s%s",
+			send->file_basename, send->suffix);
+		FILE * const pjl_file = fopen(filename, "w");
+		if (pjl_file) {
+			fwrite(send->job.data, 1, send->job.len, pjl_file);
+			fclose(pjl_file);
+		} else {
+			perror(filename);
+		}
 	}
 
-	vector_t * const v = calloc(1, sizeof(*v));
-	if (!v)
-		return;
+	send->ok = printer_send(send->host, &send->job, job_name, job_user);
+	pjl_free(&send->job);
 
-	v->p = power;
-	v->x1 = x1;
-	v->y1 = y1;
-	v->x2 = x2;
-	v->y2 = y2;
+	return NULL;
+}
+
+
+/** Start sending a page job to the printer, which takes the job over. */
+static bool
+page_send_start(
+	page_send_t * const send,
+	pjl_buf_t * const job,
+	const char * const suffix
+)
+{
+	send->job = *job;
+	*job = (pjl_buf_t) { .data = NULL };
+	snprintf(send->suffix, sizeof(send->suffix), "%s", suffix);
+	return pthread_create(&send->thread, NULL, page_send_thread, send) == 0;
+}
+
+
+/** Wait for a page job to be sent, which keeps the jobs in order. */
+static bool
+page_send_finish(
+	page_send_t * const send
+)
+{
+	pthread_join(send->thread, NULL);
+	return send->ok;
+}
+
+
+/** One stage of a spooled job, for the latency report. */
+typedef struct
+{
+	const char * name;
+	unsigned count;
+	double total;
+	double max;
+} spool_stage_t;
+
+enum { SPOOL_RECEIVE, SPOOL_COMPILE, SPOOL_QUEUE, SPOOL_SEND, SPOOL_STAGES };
+
+/** A job submitted to the spooler and the client waiting on it. */
+typedef struct
+{
+	unsigned id;
+	int conn;
+	struct ucred peer;
+	int pending;
+	bool ok;
+	pthread_cond_t done;
+} spool_job_t;
+
+/** A compiled page waiting for its printer. */
+typedef struct spool_page
+{
+	struct spool_page * next;
+	spool_job_t * job;
+	char name[HOSTNAME_NCHARS];
+	char user[HOSTNAME_NCHARS];
+	double time;
+	pjl_buf_t pjl;
+	struct timespec queued;
+} spool_page_t;
+
+/** The FIFO of pages for one printer and the thread that sends them. */
+typedef struct spool_printer
+{
+	struct spool_printer * next;
+	char host[HOSTNAME_NCHARS];
+	pthread_t thread;
+	pthread_cond_t wake;
+	spool_page_t * head;
+	spool_page_t ** tail;
+	unsigned depth;
+	unsigned sent;
+	unsigned failed;
+	double busy_until;
+	double failed_at;
+} spool_printer_t;
+
+/** Everything the spooler shares is under one lock. */
+static pthread_mutex_t spool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t spool_slot = PTHREAD_COND_INITIALIZER;
+static struct timespec spool_start;
+static spool_printer_t * spool_printers;
+static unsigned spool_jobs;
+static int spool_compiling;
+static int spool_waiting;
+static spool_stage_t spool_stages[SPOOL_STAGES] = {
+	[SPOOL_RECEIVE] = { .name = "receive" },
+	[SPOOL_COMPILE] = { .name = "compile" },
+	[SPOOL_QUEUE] = { .name = "queue" },
+	[SPOOL_SEND] = { .name = "send" },
+};
+
+
+/** Record the time spent in a stage; the spool lock must be held. */
+static void
+spool_stage_add(
+	const int stage,
+	const double dt
+)
+{
+	spool_stage_t * const s = &spool_stages[stage];
+	s->count++;
+	s->total += dt;
+	if (dt > s->max)
+		s->max = dt;
+}
+
+
+/** Report the queues and the stage latencies. */
+static void
+spool_status(
+	FILE * const out
+)
+{
+	pthread_mutex_lock(&spool_lock);
+	fprintf(out, "jobs %u compiling %d waiting %d\n",
+		spool_jobs, spool_compiling, spool_waiting);
+
+	const double now = send_time(&spool_start);
+	for (const spool_printer_t * p = spool_printers ; p ; p = p->next)
+		fprintf(out, "printer %s depth %u sent %u failed %u busy %.1f s\n",
+			p->host, p->depth, p->sent, p->failed,
+			p->busy_until > now ? p->busy_until - now : 0);
+
+	for (int i = 0 ; i < SPOOL_STAGES ; i++) {
+		const spool_stage_t * const s = &spool_stages[i];
+		fprintf(out, "stage %s count %u mean %.3f s max %.3f s\n",
+			s->name,
+			s->count,
+			s->count ? s->total / s->count : 0,
+			s->max);
+	}
+	pthread_mutex_unlock(&spool_lock);
+}
+
+
+/** A page of a job is done; wake the client thread when all are. */
+static void
+spool_page_done(
+	spool_page_t * const page,
+	const bool ok
+)
+{
+	spool_job_t * const job = page->job;
+
+	pthread_mutex_lock(&spool_lock);
+	job->ok &= ok;
+	if (--job->pending == 0)
+		pthread_cond_signal(&job->done);
+	pthread_mutex_unlock(&spool_lock);
+
+	pjl_free(&page->pjl);
+	free(page);
+}
+
+
+/** Send the pages queued for one printer back to back. */
+static void *
+spool_printer_thread(
+	void * const arg
+)
+{
+	spool_printer_t * const printer = arg;
+
+	while (1) {
+		pthread_mutex_lock(&spool_lock);
+		while (!printer->head)
+			pthread_cond_wait(&printer->wake, &spool_lock);
+
+		spool_page_t * const page = printer->head;
+		printer->head = page->next;
+		if (!printer->head)
+			printer->tail = &printer->head;
+		spool_stage_add(SPOOL_QUEUE, send_time(&page->queued));
+		pthread_mutex_unlock(&spool_lock);
+
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		const bool ok = printer_send(printer->host, &page->pjl,
+			page->name, page->user);
+
+		pthread_mutex_lock(&spool_lock);
+		spool_stage_add(SPOOL_SEND, send_time(&start));
+		printer->depth--;
+		if (ok)
+			printer->sent++;
+		else
+			printer->failed++;
+
+		/* The prediction is remade from when this page really went,
+		 * so a laser isn't kept busy by an estimate that was wrong,
+		 * or by a page that never arrived.
+		 */
+		const double now = send_time(&spool_start);
+		const double started = now - send_time(&start);
+		double busy = ok && started + page->time > now
+			? started + page->time : now;
+		for (const spool_page_t * p = printer->head ; p ; p = p->next)
+			busy += p->time;
+		printer->busy_until = busy;
+		printer->failed_at = ok ? 0 : now;
+		pthread_mutex_unlock(&spool_lock);
+
+		spool_page_done(page, ok);
+	}
+
+	return NULL;
+}
+
+
+/** Find a printer's queue, starting it if it is new; the spool lock must
+ * be held.
+ */
+static spool_printer_t *
+spool_printer_get(
+	const char * const host,
+	const size_t len
+)
+{
+	spool_printer_t * printer = spool_printers;
+	while (printer && (strncmp(printer->host, host, len) != 0
+	||  printer->host[len] != '\0'))
+		printer = printer->next;
+
+	if (printer)
+		return printer;
+
+	printer = calloc(1, sizeof(*printer));
+	if (!printer || len >= sizeof(printer->host)) {
+		free(printer);
+		return NULL;
+	}
+	memcpy(printer->host, host, len);
+	printer->tail = &printer->head;
+	pthread_cond_init(&printer->wake, NULL);
+	if (pthread_create(&printer->thread, NULL,
+		spool_printer_thread, printer) != 0) {
+		free(printer);
+		return NULL;
+	}
+	pthread_detach(printer->thread);
+	printer->next = spool_printers;
+	spool_printers = printer;
+	return printer;
+}
+
+
+/**
+ * Add a page to the end of a printer's queue.  The host may be a comma
+ * separated list of identical lasers, in which case the page goes to the
+ * one that is predicted to finish it first, from the estimated machine
+ * time of the pages already given to each.  A laser that failed a send
+ * recently is only used if all of them have.
+ */
+static bool
+spool_enqueue(
+	const char * const hosts,
+	spool_page_t * const page
+)
+{
+	pthread_mutex_lock(&spool_lock);
+
+	const double now = send_time(&spool_start);
+	spool_printer_t * printer = NULL;
+	double done = 0;
+	bool down = false;
+
+	for (const char * host = hosts ; *host ; ) {
+		const size_t len = strcspn(host, ",");
+		spool_printer_t * const p = spool_printer_get(host, len);
+		if (!p)
+			goto fail;
+
+		const double p_done = (p->busy_until > now ? p->busy_until : now)
+			+ page->time;
+		const bool p_down = p->failed_at
+			&& now - p->failed_at < SPOOL_RETRY_TIME;
+		if (!printer || (down && !p_down)
+		|| (p_down == down && p_done < done)) {
+			printer = p;
+			done = p_done;
+			down = p_down;
+		}
+
+		host += len;
+		if (*host == ',')
+			host++;
+	}
+	if (!printer)
+		goto fail;
+
+	if (strchr(hosts, ','))
+		printf("spool: job %u page to %s, done in %.1f s\n",
+			page->job->id, printer->host, done - now);
+	printer->busy_until = done;
+
+	page->next = NULL;
+	clock_gettime(CLOCK_MONOTONIC, &page->queued);
+	*printer->tail = page;
+	printer->tail = &page->next;
+	printer->depth++;
+	page->job->pending++;
+	pthread_cond_signal(&printer->wake);
+
+	pthread_mutex_unlock(&spool_lock);
+	return true;
+
+fail:
+	pthread_mutex_unlock(&spool_lock);
+	perror("spool printer");
+	return false;
+}
+
+
+/** Write one field of a spooled page: its length on a line, then it. */
+static bool
+spool_write_field(
+	const char * const field,
+	send_stats_t * const stats
+)
+{
+	char len[32];
+	const size_t field_len = strlen(field);
+	const int n = snprintf(len, sizeof(len), "%zu\n", field_len);
+
+	return send_all(spool_out_fd, len, n, stats)
+	    && send_all(spool_out_fd, field, field_len, stats);
+}
+
+
+/**
+ * In a spooled job, hand a compiled page back to the spooler instead of
+ * sending it.  Each page is the host, job name and user, each with its
+ * length in front so that no name can be read as the next field, then
+ * the estimated time and the length of the job on lines of their own
+ * and the job itself.
+ */
+static bool
+spool_write_page(
+	const char * const host,
+	const pjl_buf_t * const job
+)
+{
+	send_stats_t stats = { .bytes = 0 };
+	char header[64];
+	const int len = snprintf(header, sizeof(header), "%f\n%zu\n",
+		page_time_raster + page_time_vector,
+		job->len);
+
+	return spool_write_field(host, &stats)
+	    && spool_write_field(job_name, &stats)
+	    && spool_write_field(job_user, &stats)
+	    && len > 0 && (size_t) len < sizeof(header)
+	    && send_all(spool_out_fd, header, len, &stats)
+	    && send_all(spool_out_fd, job->data, job->len, &stats);
+}
+
+
+/** A compiled job being written to the cache. */
+typedef struct
+{
+	char key[65];
+	char tmp[PATH_MAX];
+	FILE * file;
+	long page_start;
+	long data_start;
+} cache_t;
+
+/** A cache entry is the version line, then for each page a header with
+ * its length and estimated time and the page's job.
+ */
+#define CACHE_PAGE_HEADER "page %12zu %12.3f\n"
+
+/** Age at which a partly written entry is taken to be abandoned (in s). */
+#define CACHE_TMP_AGE (3600)
+
+
+/** Make sure the input can be read twice, once to hash it. */
+static bool
+cache_input(
+	FILE ** const in
+)
+{
+	if (fseek(*in, 0, SEEK_SET) == 0)
+		return true;
+
+	FILE * const copy = tmpfile();
+	size_t len;
+	if (!copy)
+		return false;
+	while ((len = fread(buf, 1, sizeof(buf), *in)) > 0)
+		fwrite(buf, 1, len, copy);
+	if (ferror(*in) || fflush(copy) || fseek(copy, 0, SEEK_SET)) {
+		fclose(copy);
+		return false;
+	}
 
-	// Append it to the now known end of the list
-	v->next = NULL;
-	v->prev = iter;
-	*iter = v;
+	*in = copy;
+	return true;
 }
 
 
-
 /**
- * Generate a list of vectors.
- *
- * The vector format is:
- * Pp -- Power setting up to 100
- * Mx,y -- Move (start a line at x,y)
- * Lx,y -- Line to x,y from the current position
- * C -- Closing line segment to the starting position
- * X -- end of file
- *
- * Multi segment vectors are split into individual vectors, which are
- * then passed into the topological sort routine.
- *
- * Exact duplictes will be deleted to try to avoid double hits..
+ * Hash the input and every setting that changes the compiled job.  The
+ * job name is left out since it is rewritten when a job is sent from the
+ * cache, and the build is included so a new epilog doesn't reuse jobs
+ * the old one compiled.  So are the gs version, which renders the page,
+ * and the route a pdf takes, since pdf2ps and a direct run can differ.
  */
-static vectors_t *
-vectors_parse(
-	FILE * const vector_file
+static bool
+cache_key(
+	FILE * const in,
+	char * const key
 )
 {
-	vectors_t * const vectors = calloc(VECTOR_PASSES, sizeof(*vectors));
-	int mx = 0, my = 0;
-	int lx = 0, ly = 0;
-	int pass = 0;
-	int power = 100;
-	int count = 0;
+	sha256_t sha;
+	size_t len;
+	char head[4] = "";
+	sha256_init(&sha);
+
+	while ((len = fread(buf, 1, sizeof(buf), in)) > 0) {
+		if (!head[0] && len >= sizeof(head))
+			memcpy(head, buf, sizeof(head));
+		sha256_update(&sha, buf, len);
+	}
+	if (ferror(in) || fseek(in, 0, SEEK_SET))
+		return false;
 
-	char buf[256];
+	const bool pdf = strncasecmp(head, "%PDF", 4) == 0;
+	const char * const route = !pdf ? "ps"
+		: pdf_direct && gs_has_ps_pdf() ? "pdf-direct" : "pdf2ps";
+
+	len = snprintf(buf, sizeof(buf),
+		"%s %s %s gs=%s route=%s\n"
+		"resolution=%d mode=%c speed=%d power=%d repeat=%d\n"
+		"islands=%d halftone=%d,%d rotate=%d stream=%d crop=%d\n"
+		"compress=%d screen=%d focus=%d\n"
+		"frequency=%d speed=%d,%d,%d power=%d,%d,%d optimize=%d\n"
+		"page=%dx%d repeat=%dx%d gamma=%.17g curve=%d",
+		CACHE_VERSION, __DATE__, __TIME__, gs_version(), route,
+		resolution, raster_mode, raster_speed, raster_power,
+		raster_repeat,
+		raster_island_mode, halftone_mode, halftone_dot,
+		raster_rotate, raster_stream, raster_crop,
+		raster_compress_auto, screen_size, focus,
+		vector_freq,
+		vector_speed[0], vector_speed[1], vector_speed[2],
+		vector_power[0], vector_power[1], vector_power[2],
+		do_vector_optimize,
+		width, height, x_repeat, y_repeat,
+		curve_gamma, curve_points);
+	for (int i = 0 ; i < curve_points ; i++)
+		len += snprintf(buf + len, sizeof(buf) - len, " %.17g,%.17g",
+			curve_point[i].in, curve_point[i].out);
+	sha256_update(&sha, buf, len);
+
+	sha256_final(&sha, key);
+	return true;
+}
 
-	while (fgets(buf, sizeof(buf), vector_file))
-	{
-		//fprintf(stderr, "read '%s'\n", buf);
-		const char cmd = buf[0];
-		int x, y;
 
-		switch (cmd)
-		{
-		case 'P':
-		{
-			// note that they will be in bgr order in the file
-			int r, g, b;
-			sscanf(buf+1, ",%d,%d,%d", &b, &g, &r);
-			if (r == 0 && g != 0 && b == 0)
-			{
-				pass = 0;
-				power = g;
-			} else
-			if (r != 0 && g == 0 && b == 0)
-			{
-				pass = 1;
-				power = r;
-			} else
-			if (r == 0 && g == 0 && b != 0)
-			{
-				pass = 2;
-				power = b;
-			} else {
-				fprintf(stderr, "non-red/green/blue vector? %d,%d,%d\n", r, g, b);
-				exit(-1);
-			}
-			break;
-		}
-		case 'M':
-			// Start a new line.
-			// This also implicitly sets the
-			// current laser position
-			sscanf(buf+1, "%d,%d", &mx, &my);
-			lx = mx;
-			ly = my;
-			break;
-		case 'L':
-			// Add a line segment from the current
-			// point to the new point, and update
-			// the current point to the new point.
-			sscanf(buf+1, "%d,%d", &x, &y);
-			vector_create(&vectors[pass], power, lx, ly, x, y);
-			count++;
-			lx = x;
-			ly = y;
-			break;
-		case 'C':
-			// Closing segment from the current point
-			// back to the starting point
-			vector_create(&vectors[pass], power, lx, ly, mx, my);
-			lx = mx;
-			lx = my;
-			break;
-		case 'X':
-			goto done;
-		default:
-			fprintf(stderr, "Unknown command '%c'", cmd);
-			return NULL;
-		}
+/**
+ * Open the cached job for a key and mark it as recently used.  An entry
+ * that doesn't end exactly at the end of a page is removed.
+ */
+static FILE *
+cache_open(
+	const char * const key
+)
+{
+	char path[PATH_MAX];
+	char line[128];
+	snprintf(path, sizeof(path), "%s/%s.job", cache_dir, key);
+
+	FILE * const file = fopen(path, "r");
+	if (!file)
+		return NULL;
+
+	bool ok = fgets(line, sizeof(line), file)
+		&& strcmp(line, CACHE_VERSION "\n") == 0;
+	const long start = ftell(file);
+	int pages = 0;
+
+	while (ok && fgets(line, sizeof(line), file)) {
+		size_t len;
+		double time;
+		ok = sscanf(line, "page %zu %lf", &len, &time) == 2
+			&& fseek(file, len, SEEK_CUR) == 0;
+		pages++;
 	}
 
-done:
-	printf("read %u segments\n", count);
-	for (int i = 0 ; i < VECTOR_PASSES ; i++)
-	{
-		printf("Vector pass %d: power=%d speed=%d\n",
-			i,
-			vector_power[i],
-			vector_speed[i]
-		);
-		vector_stats(vectors[i].vectors);
+	struct stat st;
+	if (!ok || !pages || fstat(fileno(file), &st) < 0
+	||  ftell(file) != st.st_size) {
+		fprintf(stderr, "%s: damaged, removing it\n", path);
+		fclose(file);
+		unlink(path);
+		return NULL;
 	}
 
-	return vectors;
+	futimens(fileno(file), NULL);
+	fseek(file, start, SEEK_SET);
+	return file;
 }
 
 
-/** Find the closest vector to a given point and remove it from the list.
+/**
+ * Read the next page of a cached job, with the job name of this one.
  *
- * This might reverse a vector if it is closest to draw it in reverse
- * order.
+ * @return 1 for a page, 0 after the last one or -1 on an error.
  */
-static vector_t *
-vector_find_closest(
-	vector_t * v,
-	const int cx,
-	const int cy
+static int
+cache_read_page(
+	FILE * const file,
+	pjl_buf_t * const job,
+	double * const time
 )
 {
-	long best_dist = LONG_MAX;
-	vector_t * best = NULL;
-	int do_reverse = 0;
+	char line[128];
+	size_t len;
 
-	while (v)
-	{
-		long dx1 = cx - v->x1;
-		long dy1 = cy - v->y1;
-		long dist1 = dx1*dx1 + dy1*dy1;
+	if (!fgets(line, sizeof(line), file))
+		return 0;
+	if (sscanf(line, "page %zu %lf", &len, time) != 2)
+		return -1;
 
-		if (dist1 < best_dist)
-		{
-			best = v;
-			best_dist = dist1;
-			do_reverse = 0;
-		}
+	pjl_job_name(job);
+	const size_t start = job->len;
+	uint8_t * const data = pjl_reserve(job, len);
+	if (fread(data, 1, len, file) != len)
+		return -1;
 
-		long dx2 = cx - v->x2;
-		long dy2 = cy - v->y2;
-		long dist2 = dx2*dx2 + dy2*dy2;
-		if (dist2 < best_dist)
-		{
-			best = v;
-			best_dist = dist2;
-			do_reverse = 1;
+	/* Drop the name the job was compiled with */
+	const uint8_t * const eol = memchr(data, '\n', len);
+	if (!eol)
+		return -1;
+	const size_t skip = eol + 1 - data;
+	memmove(data, eol + 1, len - skip);
+	job->len = start + len - skip;
+	return 1;
+}
+
+
+/** Send a cached job, in the same way as a compiled one. */
+static bool
+cache_send(
+	FILE * const file,
+	const char * const host,
+	const char * const file_basename
+)
+{
+	page_send_t sender = { .host = host, .file_basename = file_basename };
+	bool sending = false;
+	bool ok = true;
+
+	for (int page = 0 ; ok ; page++) {
+		pjl_buf_t job = { .data = NULL };
+		char suffix_page[32];
+		double time;
+
+		const int rc = cache_read_page(file, &job, &time);
+		if (rc <= 0) {
+			pjl_free(&job);
+			ok = rc == 0;
+			break;
 		}
 
-		v = v->next;
-	}
+		page_time_raster = time;
+		page_time_vector = 0;
+		printf("Estimated time: %.1f s\n", time);
 
-	if (!best)
-		return NULL;
+		if (spool_out_fd >= 0) {
+			ok = spool_write_page(host, &job);
+			pjl_free(&job);
+			continue;
+		}
 
-	// Remove it from the list
-	*best->prev = best->next;
-	if (best->next)
-		best->next->prev = best->prev;
+		if (page == 0)
+			strcpy(suffix_page, ".pjl");
+		else
+			sprintf(suffix_page, "-%d.pjl", page + 1);
 
-	// If reversing is required, flip the x1/x2 and y1/y2
-	if (do_reverse)
-	{
-		int x1 = best->x1;
-		int y1 = best->y1;
-		best->x1 = best->x2;
-		best->y1 = best->y2;
-		best->x2 = x1;
-		best->y2 = y1;
+		if (sending && !page_send_finish(&sender)) {
+			pjl_free(&job);
+			sending = ok = false;
+			break;
+		}
+		sending = page_send_start(&sender, &job, suffix_page);
+		ok = sending;
 	}
 
-	best->next = NULL;
-	best->prev = NULL;
-
-	return best;
+	if (sending && !page_send_finish(&sender))
+		ok = false;
+	fclose(file);
+	return ok;
 }
 
 
 /**
- * Optimize the cut order to minimize transit time.
- *
- * Simplistic greedy algorithm: look for the closest vector that starts
- * or ends at the same point as the current point. 
- *
- * This does not split vectors.
+ * Add to the hits, misses and evictions in the cache's stats file.  The
+ * file is locked so that jobs compiled at the same time each count.
  */
-static int
-vector_optimize(
-	vectors_t * const vectors
+static void
+cache_stats_add(
+	const unsigned long hits,
+	const unsigned long misses,
+	const unsigned long evicted,
+	unsigned long * const totals
 )
 {
-	int cx = 0;
-	int cy = 0;
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/stats", cache_dir);
+
+	totals[0] = totals[1] = totals[2] = 0;
+	const int fd = open(path, O_RDWR | O_CREAT, 0666);
+	if (fd < 0 || flock(fd, LOCK_EX) < 0) {
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
 
-	vector_t * vs = NULL;
-	vector_t * vs_tail = NULL;
+	FILE * const file = fdopen(fd, "r+");
+	if (fscanf(file, "hits %lu misses %lu evicted %lu",
+		&totals[0], &totals[1], &totals[2]) != 3)
+		totals[0] = totals[1] = totals[2] = 0;
 
-	while (vectors->vectors)
-	{
-		vector_t * v = vector_find_closest(vectors->vectors, cx, cy);
+	totals[0] += hits;
+	totals[1] += misses;
+	totals[2] += evicted;
 
-		if (!vs)
-		{
-			// Nothing on the list yet
-			vs = vs_tail = v;
-		} else {
-			// Add it to the tail of the list
-			v->next = NULL;
-			v->prev = &vs_tail->next;
-			vs_tail->next = v;
-			vs_tail = v;
-		}
-		
-		// Move the current point to the end of the line segment
-		cx = v->x2;
-		cy = v->y2;
-	}
+	rewind(file);
+	fprintf(file, "hits %lu misses %lu evicted %lu\n",
+		totals[0], totals[1], totals[2]);
+	fclose(file);
+}
 
-	vector_stats(vs);
 
-	// Now replace the list in the vectors object with this new one
-	vectors->vectors = vs;
-	if (vs)
-		vs->prev = &vectors->vectors;
+/** Look a job up, counting the hit or the miss. */
+static FILE *
+cache_lookup(
+	const char * const key
+)
+{
+	unsigned long totals[3];
+	if (mkdir(cache_dir, 0777) < 0 && errno != EEXIST)
+		perror(cache_dir);
 
-	return 0;
+	FILE * const file = cache_open(key);
+	cache_stats_add(file != NULL, file == NULL, 0, totals);
+
+	printf("Cache: %s %.12s (%lu hits, %lu misses)\n",
+		file ? "hit" : "miss", key, totals[0], totals[1]);
+	return file;
 }
 
 
+/** Start writing a job to the cache as it is compiled. */
 static void
-output_vector(
-	FILE * const pjl_file,
-	const vector_t * v
+cache_store_begin(
+	cache_t * const cache
 )
 {
-	int lx = 0;
-	int ly = 0;
+	snprintf(cache->tmp, sizeof(cache->tmp), "%s/%s.%d.tmp",
+		cache_dir, cache->key, (int) getpid());
 
-	while (v)
-	{
-		if (v->x1 != lx || v->y1 != ly)
-		{
-			// Stop the laser; we need to transit
-			// and then start the laser as we go to
-			// the next point.  Note initial ";"
-			fprintf(pjl_file, ";PU%d,%d;PD%d,%d",
-				v->y1,
-				v->x1,
-				v->y2,
-				v->x2
-			);
-		} else {
-			// This is the continuation of a line, so
-			// just add additional points
-			fprintf(pjl_file, ",%d,%d",
-				v->y2,
-				v->x2
-			);
-		}
+	cache->file = fopen(cache->tmp, "w");
+	if (!cache->file) {
+		perror(cache->tmp);
+		return;
+	}
+	fputs(CACHE_VERSION "\n", cache->file);
+}
 
-		// Changing power on the fly is not supported for now
-		// \todo: Check v->power and adjust ZS, XR, etc
 
-		// Move to the next vector, updating our current point
-		lx = v->x2;
-		ly = v->y2;
-		v = v->next;
-	}
+/** Start a page; its length is filled in by cache_page_end(). */
+static void
+cache_page_begin(
+	cache_t * const cache
+)
+{
+	if (!cache->file)
+		return;
 
-	// Stop the laser (note initial ";")
-	fprintf(pjl_file, ";PU;");
+	cache->page_start = ftell(cache->file);
+	fprintf(cache->file, CACHE_PAGE_HEADER, (size_t) 0, 0.0);
+	cache->data_start = ftell(cache->file);
 }
 
-				
-static bool
-generate_vector(
-	FILE * const pjl_file,
-	FILE * const vector_file
+
+/** Finish a page with what of the job didn't go through the tee. */
+static void
+cache_page_end(
+	cache_t * const cache,
+	const pjl_buf_t * const job
 )
 {
-	vectors_t * const vectors = vectors_parse(vector_file);
+	if (!cache->file)
+		return;
 
-	fprintf(pjl_file, "IN;");
-	fprintf(pjl_file, "XR%04d;", vector_freq);
+	fwrite(job->data, 1, job->len, cache->file);
+	const long end = ftell(cache->file);
 
-	// \note: step and repeat is no longer supported
+	fseek(cache->file, cache->page_start, SEEK_SET);
+	fprintf(cache->file, CACHE_PAGE_HEADER,
+		(size_t) (end - cache->data_start),
+		page_time_raster + page_time_vector);
+	fseek(cache->file, end, SEEK_SET);
+}
 
-	for (int i = 0 ; i < VECTOR_PASSES ; i++)
-	{
-		if (do_vector_optimize)
-			vector_optimize(&vectors[i]);
 
-		const vector_t * v = vectors[i].vectors;
+typedef struct
+{
+	char name[128];
+	struct timespec used;
+	off_t size;
+} cache_entry_t;
 
-		fprintf(pjl_file, "YP%03d;", vector_power[i]);
-		fprintf(pjl_file, "ZS%03d", vector_speed[i]); // note: no ";"
-		output_vector(pjl_file, v);
-	}
 
-	fprintf(pjl_file, "\e%%0B"); // end HLGL
-	fprintf(pjl_file, "\e%%1BPU"); // start HLGL, pen up?
+static int
+cache_entry_cmp(
+	const void * const a_ptr,
+	const void * const b_ptr
+)
+{
+	const cache_entry_t * const a = a_ptr;
+	const cache_entry_t * const b = b_ptr;
 
-	return true;
+	if (a->used.tv_sec != b->used.tv_sec)
+		return a->used.tv_sec < b->used.tv_sec ? -1 : 1;
+	if (a->used.tv_nsec != b->used.tv_nsec)
+		return a->used.tv_nsec < b->used.tv_nsec ? -1 : 1;
+	return 0;
 }
 
 
 /**
+ * Remove the least recently used jobs and tours until the cache fits in
+ * its size, along with entries abandoned part way through.
  *
+ * @return The number of entries evicted.
  */
-static bool
-generate_pjl(FILE *bitmap_file, FILE *pjl_file,
-                              FILE *vector_file)
+static unsigned long
+cache_trim(
+	long * const jobs,
+	long * const bytes
+)
 {
-    int i;
+	DIR * const dir = opendir(cache_dir);
+	cache_entry_t * entries = NULL;
+	size_t count = 0;
+	size_t size = 0;
+	unsigned long evicted = 0;
+	struct dirent * d;
+
+	*jobs = *bytes = 0;
+	if (!dir) {
+		perror(cache_dir);
+		return 0;
+	}
 
-    /* Print the printer job language header. */
-    fprintf(pjl_file, "\e%%-12345X@PJL JOB NAME=%s\r\n", job_title);
-    fprintf(pjl_file, "\eE@PJL ENTER LANGUAGE=PCL\r\n");
-    /* Set autofocus on or off. */
-    fprintf(pjl_file, "\e&y%dA", focus);
-    /* Left (long-edge) offset registration.  Adjusts the position of the
-     * logical page across the width of the page.
-     */
-    fprintf(pjl_file, "\e&l0U");
-    /* Top (short-edge) offset registration.  Adjusts the position of the
-     * logical page across the length of the page.
-     */
-    fprintf(pjl_file, "\e&l0Z");
+	while ((d = readdir(dir))) {
+		const char * const ext = strrchr(d->d_name, '.');
+		struct stat st;
+		if (!ext || fstatat(dirfd(dir), d->d_name, &st, 0) < 0)
+			continue;
 
-    /* Resolution of the print. */
-    fprintf(pjl_file, "\e&u%dD", resolution);
-    /* X position = 0 */
-    fprintf(pjl_file, "\e*p0X");
-    /* Y position = 0 */
-    fprintf(pjl_file, "\e*p0Y");
-    /* PCL resolution. */
-    fprintf(pjl_file, "\e*t%dR", resolution);
+		if (strcmp(ext, ".tmp") == 0) {
+			if (time(NULL) - st.st_mtime > CACHE_TMP_AGE)
+				unlinkat(dirfd(dir), d->d_name, 0);
+			continue;
+		}
+		if ((strcmp(ext, ".job") != 0 && strcmp(ext, ".tour") != 0)
+		||  strlen(d->d_name) >= sizeof(entries->name))
+			continue;
+
+		if (count == size) {
+			size = size ? size * 2 : 64;
+			cache_entry_t * const grown = realloc(entries,
+				size * sizeof(*entries));
+			if (!grown)
+				break;
+			entries = grown;
+		}
 
-    /* If raster power is enabled and raster mode is not 'n' then add that
-     * information to the print job.
-     */
-    if (raster_power && raster_mode != 'n') {
+		cache_entry_t * const entry = &entries[count++];
+		strcpy(entry->name, d->d_name);
+		entry->used = st.st_mtim;
+		entry->size = st.st_size;
+		*bytes += st.st_size;
+	}
 
-        /* FIXME unknown purpose. */
-        fprintf(pjl_file, "\e&y0C");
+	qsort(entries, count, sizeof(*entries), cache_entry_cmp);
 
-        /* We're going to perform a raster print. */
-        generate_raster(pjl_file, bitmap_file);
-    }
+	size_t i;
+	for (i = 0 ; i < count && *bytes > cache_size_max ; i++) {
+		if (unlinkat(dirfd(dir), entries[i].name, 0) < 0
+		&&  errno != ENOENT)
+			continue;
+		*bytes -= entries[i].size;
+		evicted++;
+	}
 
-    /* If vector power is > 0 then add vector information to the print job. */
-        fprintf(pjl_file, "\eE@PJL ENTER LANGUAGE=PCL\r\n");
-        /* Page Orientation */
-        fprintf(pjl_file, "\e*r0F");
-        fprintf(pjl_file, "\e*r%dT", height * y_repeat);
-        fprintf(pjl_file, "\e*r%dS", width * x_repeat);
-        fprintf(pjl_file, "\e*r1A");
-        fprintf(pjl_file, "\e*rC");
-        fprintf(pjl_file, "\e%%1B");
+	*jobs = count - evicted;
+	free(entries);
+	closedir(dir);
+	return evicted;
+}
 
-        /* We're going to perform a vector print. */
-        generate_vector(pjl_file, vector_file);
 
-    /* Footer for printer job language. */
-    /* Reset */
-    fprintf(pjl_file, "\eE");
-    /* Exit language. */
-    fprintf(pjl_file, "\e%%-12345X");
-    /* End job. */
-    fprintf(pjl_file, "@PJL EOJ \r\n");
-    /* Pad out the remainder of the file with 0 characters. */
-    for(i = 0; i < 4096; i++) {
-        fputc(0, pjl_file);
-    }
-    return true;
+/** Keep a job that was compiled completely, then trim the cache. */
+static void
+cache_store_finish(
+	cache_t * const cache
+)
+{
+	if (!cache->file)
+		return;
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s.job", cache_dir, cache->key);
+
+	const bool written = !ferror(cache->file) && fclose(cache->file) == 0;
+	cache->file = NULL;
+	if (!written || rename(cache->tmp, path) < 0) {
+		perror(cache->tmp);
+		unlink(cache->tmp);
+		return;
+	}
+
+	long jobs;
+	long bytes;
+	unsigned long totals[3];
+	const unsigned long evicted = cache_trim(&jobs, &bytes);
+	cache_stats_add(0, 0, evicted, totals);
+
+	printf("Cache: stored, %ld entries %.1f MB (%lu evicted)\n",
+		jobs, bytes / 1048576.0, totals[2]);
 }
 
+
 /**
- * Convert the given postscript file (ps) converting it to an encapsulated
- * postscript file (eps).
- *
- * @param ps_file a file handle pointing to an opened postscript file that
- * is to be converted.
- * @param eps_file a file handle pointing to the opened encapsulated
- * postscript file to store the result.
- *
- * @return Return true if the function completes its task, false otherwise.
+ * Read one length prefixed field of a spooled page.  A field that does
+ * not fit is an error rather than being cut short.
  */
 static bool
-ps_to_eps(FILE *ps_file, FILE *eps_file)
+spool_read_field(
+	FILE * const in,
+	char * const buf,
+	const size_t size
+)
 {
-    int xoffset = 0;
-    int yoffset = 0;
+	size_t len;
+	if (fscanf(in, "%zu", &len) != 1 || fgetc(in) != '\n'
+	||  len >= size || fread(buf, 1, len, in) != len)
+		return false;
 
-    int l;
-    while (fgets((char *)buf, sizeof (buf), ps_file)) {
-        fprintf(eps_file, "%s", (char *)buf);
-        if (*buf != '%') {
-            break;
-        }
-        if (!strncasecmp((char *) buf, "%%PageBoundingBox:", 18)) {
-            int lower_left_x;
-            int lower_left_y;
-            int upper_right_x;
-            int upper_right_y;
-            if (sscanf((char *)buf + 14, "%d %d %d %d",
-                       &lower_left_x,
-                       &lower_left_y,
-                       &upper_right_x,
-                       &upper_right_y) == 4) {
-                xoffset = lower_left_x;
-                yoffset = lower_left_y;
-                width = (upper_right_x - lower_left_x);
-                height = (upper_right_y - lower_left_y);
-                fprintf(eps_file, "/setpagedevice{pop}def\n"); // use bbox
-                if (xoffset || yoffset) {
-                    fprintf(eps_file, "%d %d translate\n", -xoffset, -yoffset);
-                }
-                if (flip) {
-                    fprintf(eps_file, "%d 0 translate -1 1 scale\n", width);
-                }
-            }
-        }
-        if (!strncasecmp((char *) buf, "%!", 2)) {
-            fprintf
-                (eps_file,
-		"/=== {(        ) cvs print} def" // print a number
-		"/stroke {"
-			// check for solid red
-			"currentrgbcolor "
-			"0.0 eq "
-			"exch 0.0 eq "
-			"and "
-			"exch 1.0 eq "
-			"and "
-			// check for solid blue
-			"currentrgbcolor "
-			"0.0 eq "
-			"exch 1.0 eq "
-			"and "
-			"exch 0.0 eq "
-			"and "
-			"or "
-			// check for solid blue
-			"currentrgbcolor "
-			"1.0 eq "
-			"exch 0.0 eq "
-			"and "
-			"exch 0.0 eq "
-			"and "
-			"or "
-			"{"
-				// solid red, green or blue
-				"(P)=== "
-				"currentrgbcolor "
-				"(,)=== "
-				"100 mul round cvi === "
-				"(,)=== "
-				"100 mul round cvi === "
-				"(,)=== "
-				"100 mul round cvi = "
-				"flattenpath "
-				"{ "
-					// moveto
-					"transform (M)=== "
-					"round cvi === "
-					"(,)=== "
-					"round cvi ="
-				"}{"
-					// lineto
-					"transform(L)=== "
-					"round cvi === "
-					"(,)=== "
-					"round cvi ="
-				"}{"
-					// curveto (not implemented)
-				"}{"
-					// closepath
-					"(C)="
-				"}"
-				"pathforall newpath"
-			"}"
-			"{"
-				// Default is to just stroke
-				"stroke"
-			"}"
-			"ifelse"
-		"}bind def"
-		"/showpage {(X)= showpage}bind def"
-		"\n");
-            if (raster_mode != 'c' && raster_mode != 'g') {
-                if (screen_size == 0) {
-                    fprintf(eps_file, "{0.5 ge{1}{0}ifelse}settransfer\n");
-                } else {
-                    int s = screen_size;
-                    if (resolution >= 600) {
-                        // adjust for overprint
-                        fprintf(eps_file,
-                                "{dup 0 ne{%d %d div add}if}settransfer\n",
-                                resolution / 600, s);
-                    }
-                    fprintf(eps_file, "%d 30{%s}setscreen\n", resolution / s,
-                            (screen_size > 0) ? "pop abs 1 exch sub" :
-                            "180 mul cos exch 180 mul cos add 2 div");
-                }
-            }
-        }
-    }
-    while ((l = fread ((char *) buf, 1, sizeof (buf), ps_file)) > 0) {
-        fwrite ((char *) buf, 1, l, eps_file);
-    }
-    return true;
+	buf[len] = '\0';
+	return true;
 }
 
 
-
 /**
- * Perform range validation checks on the major global variables to ensure
- * their values are sane. If values are outside accepted tolerances then modify
- * them to be the correct value.
- *
- * @return Nothing
+ * Compile a job in a child process with its output going back to the
+ * client.  The child runs epilog again on the job's options, and its
+ * compiled pages are queued for their printers as they arrive.
  */
-static void
-range_checks(void)
+static bool
+spool_compile(
+	spool_job_t * const job,
+	int argc,
+	char ** argv,
+	const int input_fd
+)
 {
-    if (raster_power > 100)
-        raster_power = 100;
-    else
-    if (raster_power < 0)
-        raster_power = 0;
+	int fds[2];
+	if (pipe(fds) < 0) {
+		perror("spool pipe");
+		return false;
+	}
 
-    if (raster_speed > 100)
-        raster_speed = 100;
-    else
-    if (raster_speed < 1)
-        raster_speed = 1;
+	/* The options only the spooler sets come last, so that they win
+	 * over any the client sent.  Everything is set up before the fork:
+	 * the other threads may hold locks that the child would never see
+	 * released, so it only makes async-signal-safe calls until exec.
+	 */
+	char user[256] = "spool";
+	char pw_buf[4096];
+	struct passwd pw;
+	struct passwd * pw_found = NULL;
+	if (getpwuid_r(job->peer.uid, &pw, pw_buf, sizeof(pw_buf), &pw_found) == 0
+	&&  pw_found)
+		snprintf(user, sizeof(user), "%s", pw.pw_name);
+
+	char out_fd[16];
+	snprintf(out_fd, sizeof(out_fd), "%d", fds[1]);
+
+	char * child_argv[argc + 5];
+	memcpy(child_argv, argv, argc * sizeof(*argv));
+	child_argv[argc + 0] = "--user";
+	child_argv[argc + 1] = user;
+	child_argv[argc + 2] = "--spool-out";
+	child_argv[argc + 3] = out_fd;
+	child_argv[argc + 4] = NULL;
+
+	const pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		close(fds[0]);
+		close(fds[1]);
+		return false;
+	}
 
-    if (resolution > 1200)
-        resolution = 1200;
-    else
-    if (resolution < 75)
-        resolution = 75;
+	if (pid == 0) {
+		dup2(input_fd, STDIN_FILENO);
+		dup2(job->conn, STDOUT_FILENO);
+		dup2(job->conn, STDERR_FILENO);
 
-    if (screen_size < 1)
-        screen_size = 1;
+		/* Other clients see the end of their reports only once every
+		 * copy of their connection is closed.
+		 */
+		for (int fd = STDERR_FILENO + 1 ; fd < 1024 ; fd++)
+			if (fd != fds[1])
+				close(fd);
 
-    if (vector_freq < 10)
-        vector_freq = 10;
-    else
-    if (vector_freq > 5000)
-        vector_freq = 5000;
+		execv("/proc/self/exe", child_argv);
+		_exit(EXIT_FAILURE);
+	}
 
-	for (int i = 0 ; i < VECTOR_PASSES ; i++)
-	{
-	    if (vector_power[i] > 100)
-		vector_power[i] = 100;
-	    else
-	    if (vector_power[i] < 0)
-		vector_power[i] = 0;
+	close(fds[1]);
+	FILE * const pages = fdopen(fds[0], "r");
+	char host[HOSTNAME_NCHARS];
+	size_t len;
+	int c;
+	bool ok = pages != NULL;
+
+	while (ok && (c = fgetc(pages)) != EOF) {
+		ungetc(c, pages);
+		spool_page_t * const page = calloc(1, sizeof(*page));
+		if (!page) {
+			ok = false;
+			break;
+		}
+		page->job = job;
+		if (!spool_read_field(pages, host, sizeof(host))
+		||  !spool_read_field(pages, page->name, sizeof(page->name))
+		||  !spool_read_field(pages, page->user, sizeof(page->user))
+		||  fscanf(pages, "%lf %zu", &page->time, &len) != 2
+		||  fgetc(pages) != '\n') {
+			free(page);
+			ok = false;
+			break;
+		}
 
-	    if (vector_speed[i] > 100)
-		vector_speed[i] = 100;
-	    else
-	    if (vector_speed[i] < 1)
-		vector_speed[i] = 1;
+		uint8_t * const data = pjl_reserve(&page->pjl, len);
+		if (fread(data, 1, len, pages) != len) {
+			pjl_free(&page->pjl);
+			free(page);
+			ok = false;
+			break;
+		}
+		page->pjl.len = len;
+
+		if (!spool_enqueue(host, page)) {
+			pjl_free(&page->pjl);
+			free(page);
+			ok = false;
+		}
+	}
+
+	if (pages)
+		fclose(pages);
+	else
+		close(fds[0]);
+
+	int status;
+	if (waitpid(pid, &status, 0) < 0
+	||  !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		ok = false;
+
+	return ok;
+}
+
+
+/** Read a NUL terminated argument from the client. */
+static char *
+spool_read_arg(
+	FILE * const in
+)
+{
+	char * arg = NULL;
+	size_t size = 0;
+	if (getdelim(&arg, &size, '\0', in) <= 0) {
+		free(arg);
+		return NULL;
 	}
+	return arg;
 }
 
+
 /**
- * Connect to a printer.
- *
- * @param host The hostname or IP address of the printer to connect to.
- * @param timeout The number of seconds to wait before timing out on the
- * connect operation.
- * @return A socket descriptor to the printer.
+ * Serve one client: read its arguments and its postscript or pdf, wait
+ * for a compile slot, compile it and wait until every page has been
+ * sent.  A client with no arguments is asking for the status instead.
  */
-static int
-printer_connect(const char *host, const int timeout)
+static void *
+spool_conn_thread(
+	void * const arg
+)
 {
-    int socket_descriptor = -1;
-    int i;
+	spool_job_t * const job = arg;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	FILE * const in = fdopen(dup(job->conn), "r");
+	FILE * const out = fdopen(dup(job->conn), "w");
+	char ** argv = NULL;
+	int argc = 0;
+	int input_fd = -1;
+	bool ok = false;
+
+	if (!in || !out || fscanf(in, "%d", &argc) != 1 || fgetc(in) != '\n'
+	||  argc < 0 || argc > 256)
+		goto done;
+
+	if (argc == 0) {
+		spool_status(out);
+		ok = true;
+		goto done;
+	}
 
-    for (i = 0; i < timeout; i++) {
-        struct addrinfo *res;
-        struct addrinfo *addr;
-        struct addrinfo base = { 0, PF_UNSPEC, SOCK_STREAM };
-        int error_code = getaddrinfo(host, "printer", &base, &res);
+	argv = calloc(argc + 1, sizeof(*argv));
+	if (!argv)
+		goto done;
+	for (int i = 0 ; i < argc ; i++)
+		if (!(argv[i] = spool_read_arg(in)))
+			goto done;
+	if (!spool_args_allowed(argc, argv)) {
+		fprintf(out, "spool: options that name files are not allowed\n");
+		goto done;
+	}
 
-        /* Set an alarm to go off if the program has gone out to lunch. */
-        alarm(SECONDS_PER_MIN);
+	/* The rest of the connection is the input file. */
+#ifdef MFD_CLOEXEC
+	input_fd = memfd_create(FILE_BASENAME "-spool", 0);
+#endif
+	if (input_fd < 0) {
+		FILE * const input = tmpfile();
+		if (!input)
+			goto done;
+		input_fd = dup(fileno(input));
+		fclose(input);
+	}
+	{
+		size_t l;
+		char copy[8192];
+		send_stats_t stats = { .bytes = 0 };
+		while ((l = fread(copy, 1, sizeof(copy), in)) > 0)
+			if (!send_all(input_fd, copy, l, &stats))
+				goto done;
+	}
+	lseek(input_fd, 0, SEEK_SET);
+
+	pthread_mutex_lock(&spool_lock);
+	job->id = ++spool_jobs;
+	spool_stage_add(SPOOL_RECEIVE, send_time(&start));
+	spool_waiting++;
+	while (spool_compiling >= spool_workers)
+		pthread_cond_wait(&spool_slot, &spool_lock);
+	spool_waiting--;
+	spool_compiling++;
+	pthread_mutex_unlock(&spool_lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ok = spool_compile(job, argc, argv, input_fd);
+
+	pthread_mutex_lock(&spool_lock);
+	spool_stage_add(SPOOL_COMPILE, send_time(&start));
+	spool_compiling--;
+	pthread_cond_signal(&spool_slot);
+
+	/* Wait for the printers to send the pages that were queued. */
+	while (job->pending)
+		pthread_cond_wait(&job->done, &spool_lock);
+	ok &= job->ok;
+	pthread_mutex_unlock(&spool_lock);
+
+	fprintf(out, "spool: job %u %s\n", job->id, ok ? "sent" : "failed");
+	printf("spool: job %u %s\n", job->id, ok ? "sent" : "failed");
+	fflush(stdout);
 
-        /* If getaddrinfo did not return an error code then we attempt to
-         * connect to the printer and establish a socket.
-         */
-        if (!error_code) {
-            for (addr = res; addr; addr = addr->ai_next) {
-		const struct sockaddr_in * addr_in = (void*) addr->ai_addr;
-		if (addr_in)
-		printf("trying to connect to %s:%d\n",
-			inet_ntoa(addr_in->sin_addr),
-			ntohs(addr_in->sin_port)
-		);
+done:
+	if (!job->id && !ok)
+		fprintf(stderr, "spool: bad request\n");
+	if (in)
+		fclose(in);
+	if (out)
+		fclose(out);
+	if (input_fd >= 0)
+		close(input_fd);
+	for (int i = 0 ; argv && i < argc ; i++)
+		free(argv[i]);
+	free(argv);
+	close(job->conn);
+	pthread_cond_destroy(&job->done);
+	free(job);
+	return NULL;
+}
 
-                socket_descriptor = socket(addr->ai_family, addr->ai_socktype,
-                                           addr->ai_protocol);
-                if (socket_descriptor >= 0) {
-                    if (!connect(socket_descriptor, addr->ai_addr,
-                                 addr->ai_addrlen)) {
-                        break;
-                    } else {
-                        close(socket_descriptor);
-                        socket_descriptor = -1;
-                    }
-                }
-            }
-            freeaddrinfo(res);
-        }
-        if (socket_descriptor >= 0) {
-            break;
-        }
 
-        /* Sleep for a second then try again. */
-        sleep(1);
-    }
-    if (i >= timeout) {
-        fprintf(stderr, "Cannot connect to %s\n", host);
-        return -1;
-    }
-    /* Disable the timeout alarm. */
-    alarm(0);
-    /* Return the newly opened socket descriptor */
-    return socket_descriptor;
+/** Open the spooler's unix socket, or connect to it. */
+static int
+spool_socket_open(
+	const char * const path,
+	const bool listening
+)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	if (listening) {
+		/* Only the owner and the group may submit jobs. */
+		unlink(path);
+		const mode_t mask = umask(0117);
+		const int bound = bind(fd, (void *) &addr, sizeof(addr));
+		umask(mask);
+		if (bound == 0 && listen(fd, 16) == 0)
+			return fd;
+	} else {
+		if (connect(fd, (void *) &addr, sizeof(addr)) == 0)
+			return fd;
+	}
+
+	perror(path);
+	close(fd);
+	return -1;
 }
 
+
 /**
- * Disconnect from a printer.
- *
- * @param socket_descriptor the descriptor of the printer that is to be
- * disconnected from.
- * @return True if the printer connection was successfully closed, false otherwise.
+ * Run the spooler.  Jobs arrive on a unix socket, are compiled by up to
+ * spool_workers processes at a time and are sent through one FIFO per
+ * printer, so that each laser gets its jobs back to back.
  */
-static bool
-printer_disconnect(int socket_descriptor)
+static int
+spool_serve(
+	const char * const path
+)
 {
-    int error_code;
-    error_code = close(socket_descriptor);
-    /* Report on possible errors to standard error. */
-    if (error_code == -1) {
-        switch (errno) {
-        case EBADF:
-            perror("Socket descriptor given was not valid.");
-            break;
-        case EINTR:
-            perror("Closing socket descriptor was interrupted by a signal.");
-            break;
-        case EIO:
-            perror("I/O error occurred during closing of socket descriptor.");
-            break;
-        }
-    }
+	const int listen_fd = spool_socket_open(path, true);
+	if (listen_fd < 0)
+		return EXIT_FAILURE;
+
+	signal(SIGPIPE, SIG_IGN);
+	clock_gettime(CLOCK_MONOTONIC, &spool_start);
+
+	printf("spool: listening on %s with %d workers\n", path, spool_workers);
+	fflush(stdout);
+
+	while (1) {
+		const int conn = accept(listen_fd, NULL, NULL);
+		if (conn < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("accept");
+			return EXIT_FAILURE;
+		}
 
-    /* Return status of disconnect operation to the calling function. */
-    if (error_code) {
-        return false;
-    } else {
-        return true;
-    }
+		spool_job_t * const job = calloc(1, sizeof(*job));
+		socklen_t len = sizeof(job->peer);
+		pthread_t thread;
+		if (!job) {
+			close(conn);
+			continue;
+		}
+		job->conn = conn;
+		job->ok = true;
+		pthread_cond_init(&job->done, NULL);
+		getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &job->peer, &len);
+
+		if (pthread_create(&thread, NULL, spool_conn_thread, job) != 0) {
+			perror("spool thread");
+			close(conn);
+			pthread_cond_destroy(&job->done);
+			free(job);
+			continue;
+		}
+		pthread_detach(thread);
+	}
 }
 
+
 /**
+ * Submit a job to the spooler, or ask for its status with no arguments,
+ * and copy its report to stdout.
  *
+ * @return EXIT_SUCCESS if the spooler sent the job to the printer.
  */
-static bool
-printer_send(const char *host, FILE *pjl_file)
+static int
+spool_submit(
+	const char * const path,
+	const int argc,
+	char ** const argv,
+	FILE * const input
+)
 {
-    char localhost[HOSTNAME_NCHARS] = "";
-    unsigned char lpdres;
-    int socket_descriptor = -1;
-
-    gethostname(localhost, sizeof(localhost));
-    {
-        char *d = strchr(localhost, '.');
-        if (d) {
-            *d = 0;
-        }
-    }
-
-	if (debug)
-		printf("printer host: '%s'\n", host);
-
-    /* Connect to the printer. */
-    socket_descriptor = printer_connect(host, PRINTER_MAX_WAIT);
-
-	if (debug)
-		printf("printer host: '%s' fd %d\n", host, socket_descriptor);
-
-    // talk to printer
-    sprintf(buf, "\002%s\n", queue);
-    write(socket_descriptor, (char *)buf, strlen(buf));
-    read(socket_descriptor, &lpdres, 1);
-    if (lpdres) {
-        fprintf (stderr, "Bad response from %s, %u\n", host, lpdres);
-        return false;
-    }
-    sprintf(buf, "H%s\n", localhost);
-    sprintf(buf + strlen(buf) + 1, "P%s\n", job_user);
-    sprintf(buf + strlen(buf) + 1, "J%s\n", job_title);
-    sprintf(buf + strlen(buf) + 1, "ldfA%s%s\n", job_name, localhost);
-    sprintf(buf + strlen(buf) + 1, "UdfA%s%s\n", job_name, localhost);
-    sprintf(buf + strlen(buf) + 1, "N%s\n", job_title);
-    sprintf(buf + strlen(buf) + 1, "\002%d cfA%s%s\n", (int)strlen(buf), job_name, localhost);
-    write(socket_descriptor, buf + strlen(buf) + 1, strlen(buf + strlen(buf) + 1));
+	const int fd = spool_socket_open(path, false);
+	if (fd < 0)
+		return EXIT_FAILURE;
+
+	FILE * const out = fdopen(fd, "w");
+	fprintf(out, "%d\n", argc);
+	for (int i = 0 ; i < argc ; i++)
+		fwrite(argv[i], 1, strlen(argv[i]) + 1, out);
+
+	if (input) {
+		size_t l;
+		char copy[8192];
+		while ((l = fread(copy, 1, sizeof(copy), input)) > 0)
+			fwrite(copy, 1, l, out);
+	}
+	fflush(out);
+	shutdown(fd, SHUT_WR);
+
+	FILE * const in = fdopen(dup(fd), "r");
+	char line[1024];
+	bool ok = argc == 0;
+	while (in && fgets(line, sizeof(line), in)) {
+		fputs(line, stdout);
+		if (strncmp(line, "spool: job ", 11) == 0)
+			ok = strstr(line, " sent") != NULL;
+	}
 
-    read(socket_descriptor, &lpdres, 1);
-    if (lpdres) {
-        fprintf(stderr, "Bad response from %s, %u\n", host, lpdres);
-        return false;
-    }
-    write(socket_descriptor, (char *)buf, strlen(buf) + 1);
-    read(socket_descriptor, &lpdres, 1);
-    if (lpdres) {
-        fprintf(stderr, "Bad response from %s, %u\n", host, lpdres);
-        return false;
-    }
-    {
-        {
-            struct stat file_stat;
-            if (fstat(fileno(pjl_file), &file_stat)) {
-                perror(buf);
-                return false;
-            }
-            sprintf((char *) buf, "\003%u dfA%s%s\n", (int) file_stat.st_size, job_name, localhost);
-		printf("job '%s': size %u\n", job_name, (int) file_stat.st_size);
-        }
-        write(socket_descriptor, (char *)buf, strlen(buf));
-        read(socket_descriptor, &lpdres, 1);
-        if (lpdres) {
-            fprintf(stderr, "Bad response from %s, %u\n", host, lpdres);
-            return false;
-        }
-        {
-            int l;
-            while ((l = fread((char *)buf, 1, sizeof (buf), pjl_file)) > 0) {
-		write(socket_descriptor, buf, l);
-            }
-        }
-    }
-    // dont wait for a response...
-    printer_disconnect(socket_descriptor);
-    return true;
+	if (in)
+		fclose(in);
+	fclose(out);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 
@@ -1575,10 +6974,11 @@ static void usage(int rc, const char * const msg)
 	static const char usage_str[] =
 "Usage: epilog [options] < file.ps\n"
 "Options:\n"
-" -p | --printer ip                  IP address of printer\n"
+" -p | --printer ip[:port][,...]     IP address of printer, or lasers to share with --submit\n"
 " -P | --preset name                 Select a default preset\n"
 " -a | --autofocus                   Enable auto focus\n"
 " -n | --job Jobname                 Set the job name to display\n"
+" -u | --user Username               Set the job owner (default the current user)\n"
 "\n"
 "Raster options:\n"
 " -d | --dpi 300                     Resolution of raster artwork\n"
@@ -1586,6 +6986,23 @@ static void usage(int rc, const char * const msg)
 " -r | --raster-speed 0-100          Raster speed\n"
 " -m | --mode mono/grey/color        Mode for rasterization (default mono)\n"
 " -s | --screen-size N               Photograph screen size (default 8)\n"
+" -I | --islands                     Raster separate areas as their own blocks\n"
+" -H | --halftone ordered/floyd/jarvis Halftone mono mode in epilog instead of gs\n"
+" -t | --dot-size N                  Halftone dot size in pixels (default 1)\n"
+" -c | --curve file                  Material response curve for grey/color\n"
+" -G | --gamma G                     Gamma of the response curve (default 1)\n"
+" -T | --rotate auto/0/90            Scan the raster along the faster axis\n"
+" -z | --compress auto/packbits      Raster compression selection (default packbits)\n"
+" -j | --threads N                   Raster encoding threads (default ncpu)\n"
+" -b | --bands N                     Render with N gs threads in bands (0 = ncpu)\n"
+" -S | --stream                      Stream mono/grey rasters from gs without a temp file\n"
+" -N | --pdf-direct                  Run pdf input in gs without pdf2ps\n"
+" -C | --crop                        Only render the raster marks, skipping pages without any\n"
+" -L | --lpd-stream MB               Send each page straight to the printer, declaring\n"
+"                                    and padding it to MB\n"
+" -K | --cache dir                   Keep compiled jobs to send again without gs, and\n"
+"                                    the vector order of each job for its next revision\n"
+" -k | --cache-size MB               Size of the job cache (default 1024)\n"
 "\n"
 "Vector options:\n"
 " -f | --frequency 10-5000           Vector frequency\n"
@@ -1593,12 +7010,21 @@ static void usage(int rc, const char * const msg)
 " -V | --vector-power 0-100[,G,B]    Vector power for the R,G and B passes\n"
 " -v | --vector-speed 0-100[,G,B]    Vector speed\n"
 "\n"
+"Spooler options:\n"
+" -Q | --spool socket                Run a spooler for jobs on a unix socket\n"
+" -W | --spool-workers N             Jobs the spooler compiles at once (default 2)\n"
+" -q | --submit socket               Send this job through the spooler\n"
+" -Z | --spool-status socket         Report the spooler's queues and latencies\n"
+"\n"
 " If only one power or speed is specified it will be used for all three\n"
 "";
 	fprintf(stderr, "%s%s\n", msg, usage_str);
 	exit(rc);
 }
 
+static const char short_options[] =
+	"Dp:P:n:u:d:r:R:v:V:g:G:b:B:m:f:s:j:SCNL:K:k:Q:W:q:Z:o:Iz:H:t:c:T:aO";
+
 static const struct option long_options[] = {
 	{ "debug",		no_argument, NULL, 'D' },
 	{ "printer",		required_argument, NULL, 'p' },
@@ -1610,6 +7036,27 @@ static const struct option long_options[] = {
 	{ "raster-speed",	required_argument, NULL, 'r' },
 	{ "mode",		required_argument, NULL, 'm' },
 	{ "screen-size",	required_argument, NULL, 's' },
+	{ "threads",		required_argument, NULL, 'j' },
+	{ "bands",		required_argument, NULL, 'b' },
+	{ "stream",		no_argument, NULL, 'S' },
+	{ "crop",		no_argument, NULL, 'C' },
+	{ "pdf-direct",		no_argument, NULL, 'N' },
+	{ "lpd-stream",		required_argument, NULL, 'L' },
+	{ "cache",		required_argument, NULL, 'K' },
+	{ "cache-size",		required_argument, NULL, 'k' },
+	{ "spool",		required_argument, NULL, 'Q' },
+	{ "spool-workers",	required_argument, NULL, 'W' },
+	{ "submit",		required_argument, NULL, 'q' },
+	{ "spool-status",	required_argument, NULL, 'Z' },
+	{ "spool-out",		required_argument, NULL, 'o' },
+	{ "user",		required_argument, NULL, 'u' },
+	{ "islands",		no_argument, NULL, 'I' },
+	{ "compress",		required_argument, NULL, 'z' },
+	{ "halftone",		required_argument, NULL, 'H' },
+	{ "curve",		required_argument, NULL, 'c' },
+	{ "rotate",		required_argument, NULL, 'T' },
+	{ "gamma",		required_argument, NULL, 'G' },
+	{ "dot-size",		required_argument, NULL, 't' },
 	{ "frequency",		required_argument, NULL, 'f' },
 	{ "vector-power",	required_argument, NULL, 'V' },
 	{ "vector-speed",	required_argument, NULL, 'v' },
@@ -1618,6 +7065,59 @@ static const struct option long_options[] = {
 };
 
 
+/**
+ * Check the options a spooler client sent.  The job is compiled with
+ * the spooler's permissions, so the options that name its files or
+ * descriptors (the cache, a curve, the spooler's own options and the
+ * page pipe) are refused, as is an input file name: the input is
+ * always what the client sent after its options.
+ *
+ * @return Return true if the job can be compiled with these options.
+ */
+static bool
+spool_args_allowed(
+	const int argc,
+	char * const argv[]
+)
+{
+	static const char refused[] = "KcoQqZW";
+
+	for (int i = 1 ; i < argc ; i++) {
+		const char * const arg = argv[i];
+		if (arg[0] != '-' || arg[1] == '\0')
+			return false;
+
+		if (arg[1] == '-') {
+			// A long option must be spelled out in full
+			const size_t len = strcspn(arg + 2, "=");
+			const struct option * o = long_options;
+			while (o->name
+			&& (strncmp(o->name, arg + 2, len) != 0 || o->name[len]))
+				o++;
+			if (!o->name || strchr(refused, o->val))
+				return false;
+			if (o->has_arg == required_argument && !arg[2 + len])
+				i++;
+			continue;
+		}
+
+		// Short options may be bundled, up to one that takes a value
+		for (const char * c = arg + 1 ; *c ; c++) {
+			const char * const spec = strchr(short_options, *c);
+			if (!spec || *c == ':' || strchr(refused, *c))
+				return false;
+			if (spec[1] == ':') {
+				if (!c[1])
+					i++;
+				break;
+			}
+		}
+	}
+
+	return true;
+}
+
+
 /*
  * Look for "X,Y,Z" for each power setting, or "X" for all three.
  * Handle the case where we have been given floating point values,
@@ -1649,7 +7149,8 @@ vector_param_set(
 
 
 /**
- * Main entry point for the program.
+ * Run one job, or the spooler, from its command line.  Jobs compiled by
+ * the spooler come through here in a child process as well.
  *
  * @param argc The number of command line options passed to the program.
  * @param argv An array of strings where each string represents a command line
@@ -1657,8 +7158,8 @@ vector_param_set(
  * @return An integer where 0 represents successful termination, any other
  * value represents an error code.
  */
-int
-main(int argc, char *argv[])
+static int
+epilog_main(int argc, char *argv[])
 {
 	const char * host = "192.168.1.4";
 
@@ -1667,7 +7168,7 @@ main(int argc, char *argv[])
 		const char ch = getopt_long(
 			argc,
 			argv,
-			"Dp:P:n:d:r:R:v:V:g:G:b:B:m:f:s:aO",
+			short_options,
 			long_options,
 			NULL
 		);
@@ -1679,6 +7180,7 @@ main(int argc, char *argv[])
 		case 'p': host = optarg; break;
 		case 'P': usage(EXIT_FAILURE, "Presets are not supported yet\n"); break;
 		case 'n': job_name = optarg; break;
+		case 'u': job_user = optarg; break;
 		case 'd': resolution = atoi(optarg); break;
 		case 'r': raster_speed = atoi(optarg); break;
 		case 'R': raster_power = atoi(optarg); break;
@@ -1693,6 +7195,73 @@ main(int argc, char *argv[])
 		case 'm': raster_mode = tolower(*optarg); break;
 		case 'f': vector_freq = atoi(optarg); break;
 		case 's': screen_size = atoi(optarg); break;
+		case 'j': raster_threads = atoi(optarg); break;
+		case 'b': raster_bands = atoi(optarg); break;
+		case 'S': raster_stream = 1; break;
+		case 'C': raster_crop = 1; break;
+		case 'N': pdf_direct = 1; break;
+		case 'L':
+		{
+			char * end;
+			const long mb = strtol(optarg, &end, 10);
+			if (end == optarg || *end || mb <= 0 || mb > LONG_MAX >> 20)
+				usage(EXIT_FAILURE, "lpd-stream must be a size in MB\n");
+			lpd_stream_size = mb << 20;
+			break;
+		}
+		case 'K': cache_dir = optarg; break;
+		case 'k': cache_size_max = atol(optarg) << 20; break;
+		case 'Q':
+		case 'q':
+		case 'Z':
+			spool_mode = ch;
+			spool_socket = optarg;
+			break;
+		case 'W': spool_workers = atoi(optarg); break;
+		case 'o':
+			/* A job compiled for the spooler reports back a line at
+			 * a time and sends its pages down this pipe.
+			 */
+			spool_out_fd = atoi(optarg);
+			setvbuf(stdout, NULL, _IOLBF, 0);
+			break;
+		case 'I': raster_island_mode = 1; break;
+		case 'H':
+			if (strcasecmp(optarg, "ordered") == 0)
+				halftone_mode = 'o';
+			else
+			if (strcasecmp(optarg, "floyd") == 0)
+				halftone_mode = 'f';
+			else
+			if (strcasecmp(optarg, "jarvis") == 0)
+				halftone_mode = 'j';
+			else
+				usage(EXIT_FAILURE, "halftone must be ordered, floyd or jarvis\n");
+			break;
+		case 't': halftone_dot = atoi(optarg); break;
+		case 'c':
+			if (!curve_load(optarg))
+				usage(EXIT_FAILURE, "unable to load curve");
+			break;
+		case 'T':
+			raster_rotate = strcmp(optarg, "auto") == 0 ? -1 : atoi(optarg);
+			if (raster_rotate != -1 && raster_rotate != 0 && raster_rotate != 90)
+				usage(EXIT_FAILURE, "rotate must be auto, 0 or 90");
+			break;
+		case 'G':
+			curve_gamma = atof(optarg);
+			if (curve_gamma <= 0)
+				usage(EXIT_FAILURE, "gamma must be positive");
+			break;
+		case 'z':
+			if (strcmp(optarg, "auto") == 0)
+				raster_compress_auto = 1;
+			else
+			if (strcmp(optarg, "packbits") == 0)
+				raster_compress_auto = 0;
+			else
+				usage(EXIT_FAILURE, "compress must be auto or packbits");
+			break;
 		case 'a': focus = AUTO_FOCUS; break;
 		case 'O': do_vector_optimize = 0; break;
 		default: usage(EXIT_FAILURE, "Unknown argument\n"); break;
@@ -1707,7 +7276,18 @@ main(int argc, char *argv[])
 	if (!host)
 		usage(EXIT_FAILURE, "Printer host must be specfied\n");
 
+	if (spool_mode && spool_out_fd >= 0)
+		usage(EXIT_FAILURE, "A spooled job can't use the spooler\n");
+	if (strchr(host, ',') && spool_mode != 'q' && spool_out_fd < 0)
+		usage(EXIT_FAILURE, "A list of printers needs the spooler\n");
+	if (spool_mode == 'Q')
+		return spool_serve(spool_socket);
+	if (spool_mode == 'Z')
+		return spool_submit(spool_socket, 0, NULL, NULL);
+
 	// Skip any of the processed arguments
+	char ** const options = argv;
+	const int noptions = optind;
 	argc -= optind;
 	argv += optind;
 
@@ -1738,6 +7318,9 @@ main(int argc, char *argv[])
 	}
 
 	job_title = job_name;
+	job_input = argc ? realpath(filename, NULL) : NULL;
+	if (!job_input)
+		job_input = filename;
 
 	/* Gather the postscript file from either standard input or a filename
 	 * specified as a command line argument.
@@ -1749,6 +7332,28 @@ main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	/* The spooler gets the same options, less the submit one, and the
+	 * input file itself.
+	 */
+	if (spool_mode == 'q')
+	{
+		char * spool_argv[noptions + 2];
+		int n = 0;
+		for (int i = 0 ; i < noptions ; i++)
+		{
+			if (strcmp(options[i], "-q") == 0
+			||  strcmp(options[i], "--submit") == 0)
+				i++;
+			else
+			if (strncmp(options[i], "-q", 2) != 0
+			&&  strncmp(options[i], "--submit=", 9) != 0)
+				spool_argv[n++] = options[i];
+		}
+		spool_argv[n++] = "-n";
+		spool_argv[n++] = (char *) job_name;
+		return spool_submit(spool_socket, n, spool_argv, file_cups);
+	}
+
 	// Report the settings on stdout
 	printf(
 		"Job: %s (%s)\n"
@@ -1773,9 +7378,9 @@ main(int argc, char *argv[])
     /* Strings designating filenames. */
     char file_basename[FILENAME_NCHARS];
     char filename_bitmap[FILENAME_NCHARS];
+    char filename_bbox[FILENAME_NCHARS];
     char filename_eps[FILENAME_NCHARS];
     char filename_pdf[FILENAME_NCHARS];
-    char filename_pjl[FILENAME_NCHARS];
     char filename_ps[FILENAME_NCHARS];
     char filename_vector[FILENAME_NCHARS];
 
@@ -1786,27 +7391,81 @@ main(int argc, char *argv[])
      * program.
      */
     sprintf(file_basename, "%s/%s-%d", TMP_DIRECTORY, FILE_BASENAME, getpid());
-    sprintf(filename_bitmap, "%s.bmp", file_basename);
-    sprintf(filename_eps, "%s.eps", file_basename);
-    sprintf(filename_pjl, "%s.pjl", file_basename);
-    sprintf(filename_vector, "%s.vector", file_basename);
+
+    /* A job compiled before from the same input and settings is sent
+     * from the cache without running gs at all; otherwise it is stored
+     * as it is compiled.
+     */
+    cache_t cache = { .file = NULL };
+    if (cache_dir) {
+        if (!cache_input(&file_cups) || !cache_key(file_cups, cache.key)) {
+            perror(filename);
+            return 1;
+        }
+        FILE * const cached = cache_lookup(cache.key);
+        if (cached) {
+            fclose(file_cups);
+            if (!cache_send(cached, host, file_basename)) {
+                perror("Could not send pjl file to printer.\n");
+                return 1;
+            }
+            return 0;
+        }
+        cache_store_begin(&cache);
+    }
+
+    tmp_file_create(filename_bitmap, file_basename, ".bmp");
+    tmp_file_create(filename_bbox, file_basename, ".bbox");
+    tmp_file_create(filename_eps, file_basename, ".eps");
+    tmp_file_create(filename_vector, file_basename, ".vector");
+    filename_ps[0] = '\0';
 
     /* File handles. */
     FILE *file_bitmap;
     FILE *file_pdf;
     FILE *file_ps;
     FILE *file_pjl;
-    FILE *file_vector;
 
 
     /* Check whether the incoming data is ps or pdf data. */
     fread((char *)buf, 1, 4, file_cups);
     rewind(file_cups);
+    if (strncasecmp((char *)buf, "%PDF", 4) == 0 && pdf_direct
+    &&  !gs_has_ps_pdf()) {
+        fprintf(stderr, "gs has no postscript pdf interpreter, using pdf2ps\n");
+        pdf_direct = 0;
+    }
+    if (strncasecmp((char *)buf, "%PDF", 4) == 0 && pdf_direct) {
+        /* gs reads the pdf itself after the stroke capture prologue, so
+         * only a pdf on stdin has to be spooled to a file.
+         */
+        if (argc) {
+            pdf_input = filename;
+        } else {
+            tmp_file_create(filename_pdf, file_basename, ".pdf");
+            file_pdf = fopen(filename_pdf, "w");
+            if (!file_pdf) {
+                perror(filename_pdf);
+                return 1;
+            }
+            while ((l = fread((char *)buf, 1, sizeof(buf), file_cups)) > 0) {
+                fwrite((char *)buf, 1, l, file_pdf);
+            }
+            fclose(file_pdf);
+            pdf_input = filename_pdf;
+        }
+        fclose(file_cups);
+
+        if (!pdf_prologue(filename_eps)) {
+            return 1;
+        }
+        file_ps = NULL;
+    } else
     if (strncasecmp((char *)buf, "%PDF", 4) == 0) {
         /* We have a pdf file. */
 
         /* Setup the filename for the output pdf file. */
-        sprintf(filename_pdf, "%s.pdf", file_basename);
+        tmp_file_create(filename_pdf, file_basename, ".pdf");
 
         /* Open the destination pdf file. */
         file_pdf = fopen(filename_pdf, "w");
@@ -1824,24 +7483,16 @@ main(int argc, char *argv[])
         fclose(file_pdf);
 
         /* Setup the postscript output filename. */
-        sprintf(filename_ps, "%s.ps", file_basename);
+        tmp_file_create(filename_ps, file_basename, ".ps");
 
-        /* Execute the command pdf2ps to convert the pdf file to ps. */
-        sprintf(buf, "pdf2ps %s %s", filename_pdf, filename_ps);
-        if (debug) {
-            printf("executing: %s\n", buf);
-        }
-        if (system(buf)) {
+        /* Convert the pdf file to ps. */
+        if (!execute_pdf2ps(filename_pdf, filename_ps)) {
             fprintf(stderr, "Failure to execute pdf2ps. Quitting...");
             return 1;
         }
 
-        if (!debug) {
-            /* Debug is disabled so remove generated pdf file. */
-            if (unlink(filename_pdf)) {
-                perror(filename_pdf);
-            }
-        }
+        /* Remove the generated pdf file. */
+        tmp_file_remove(filename_pdf, file_basename, ".pdf");
 
         /* Set file_ps to the generated ps file. */
         file_ps  = fopen(filename_ps, "r");
@@ -1850,95 +7501,242 @@ main(int argc, char *argv[])
         file_ps = file_cups;
     }
 
-    /* Open the encapsulated postscript file for writing. */
-    FILE * const file_eps = fopen(filename_eps, "w");
-    if (!file_eps) {
-        perror(filename_eps);
-        return 1;
-    }
-    /* Convert postscript to encapsulated postscript. */
-    if (!ps_to_eps(file_ps, file_eps)) {
-        perror("Error converting postscript to encapsulated postscript.");
-        fclose(file_eps);
-        return 1;
-    }
+    if (file_ps) {
+        /* Open the encapsulated postscript file for writing. */
+        FILE * const file_eps = fopen(filename_eps, "w");
+        if (!file_eps) {
+            perror(filename_eps);
+            return 1;
+        }
+        /* Convert postscript to encapsulated postscript. */
+        if (!ps_to_eps(file_ps, file_eps)) {
+            perror("Error converting postscript to encapsulated postscript.");
+            fclose(file_eps);
+            return 1;
+        }
 
-    /* Cleanup after encapsulated postscript creation. */
-    fclose(file_eps);
-    if (file_ps != stdin) {
-        fclose(file_ps);
-        if (unlink(filename_ps)) {
-            perror(filename_ps);
+        /* Cleanup after encapsulated postscript creation. */
+        fclose(file_eps);
+        if (file_ps != stdin) {
+            fclose(file_ps);
+        }
+        if (filename_ps[0]) {
+            tmp_file_remove(filename_ps, file_basename, ".ps");
         }
     }
 
+	/* Cut-only jobs don't need a bitmap, just the vector records */
+	int raster_enabled = raster_power && raster_mode != 'n';
+
+	/* The crop pre-pass also collects the vector records, and finds
+	 * out if there is anything to render at all.
+	 */
+	const int vectors_done = raster_enabled && raster_crop;
+	if (vectors_done) {
+		const int marks = execute_ghostscript_bbox(
+			filename_eps,
+			filename_vector,
+			filename_bbox,
+			resolution
+		);
+		if (marks < 0) {
+			perror("Failure to execute ghostscript command.\n");
+			return 1;
+		}
+		tmp_file_remove(filename_bbox, file_basename, ".bbox");
+
+		FILE * const file_vector = fopen(filename_vector, "r");
+		const int pages = file_vector ? vectors_count_pages(file_vector) : 1;
+		if (file_vector)
+			fclose(file_vector);
+
+		if (pages > 1) {
+			/* The window and the marks are only for the first page */
+			printf("Raster cropping disabled for %d pages\n", pages);
+			raster_window_width = 0;
+			raster_crop_x = 0;
+			raster_crop_y = 0;
+			raster_stream = 0;
+		} else
+		if (!marks) {
+			raster_enabled = 0;
+			raster_stream = 0;
+		}
+	}
+	const char * const filename_gs_vector =
+		vectors_done ? "/dev/null" : filename_vector;
+
 	const char * const raster_string =
+		!raster_enabled ? "nullpage" :
 		raster_mode == 'c' ? "bmp16m" :
 		raster_mode == 'g' ? "bmpgray" :
+		halftone_mode ? "bmpgray" :
 		"bmpmono";
 
-    	if(!execute_ghostscript(
-		filename_bitmap,
-		filename_eps,
-		filename_vector,
-		raster_string,
-		resolution
-	)) {
-		perror("Failure to execute ghostscript command.\n");
-		return 1;
+	if (vectors_done && !raster_enabled) {
+		file_bitmap = NULL;
+	} else
+	if (raster_stream) {
+		file_bitmap = execute_ghostscript_stream(
+			filename_eps,
+			filename_gs_vector,
+			raster_string,
+			resolution
+		);
+		if (!file_bitmap) {
+			perror("Failure to execute ghostscript command.\n");
+			return 1;
+		}
+	} else {
+		if(!execute_ghostscript(
+			raster_enabled ? filename_bitmap : "/dev/null",
+			filename_eps,
+			filename_gs_vector,
+			raster_string,
+			resolution
+		)) {
+			perror("Failure to execute ghostscript command.\n");
+			return 1;
+		}
+		file_bitmap = raster_enabled ? fopen(filename_bitmap, "r") : NULL;
 	}
 
-    /* Open file handles needed by generation of the printer job language
-     * file.
+    /* The vector records for every page are complete, unless gs is still
+     * streaming the raster.  Then each page's records are complete once
+     * its bitmap starts, and the pages are counted as they arrive.
      */
-    file_bitmap = fopen(filename_bitmap, "r");
-    file_vector = fopen(filename_vector, "r");
-    file_pjl = fopen(filename_pjl, "w");
-    if (!file_pjl) {
-        perror(filename_pjl);
+    int pages = 1;
+    if (raster_stream && !raster_stream_next(file_bitmap)) {
+        fprintf(stderr, "No pages from gs\n");
         return 1;
     }
-    /* Execute the generation of the printer job language (pjl) file. */
-    if (!generate_pjl(file_bitmap, file_pjl, file_vector)) {
-        perror("Generation of pjl file failed.\n");
-        fclose(file_pjl);
+    FILE *file_vector = fopen(filename_vector, "r");
+    if (!file_vector) {
+        perror(filename_vector);
         return 1;
     }
-    /* Close open file handles. */
-    fclose(file_bitmap);
-    fclose(file_pjl);
-    fclose(file_vector);
-
-    /* Cleanup unneeded files provided that debug mode is disabled. */
-    if (!debug) {
-        if (unlink(filename_bitmap)) {
-            perror(filename_bitmap);
+    if (!raster_stream)
+        pages = vectors_count_pages(file_vector);
+
+    /* Each page is its own job, sent while the next one is generated. */
+    page_send_t sender = { .host = host, .file_basename = file_basename };
+    bool sending = false;
+
+    for (int page = 0; page < pages; page++) {
+        pjl_buf_t job = { .data = NULL };
+        char suffix_page[32];
+        if (page == 0) {
+            strcpy(suffix_page, ".pjl");
+        } else {
+            sprintf(suffix_page, "-%d.pjl", page + 1);
         }
-        if (unlink(filename_eps)) {
-            perror(filename_eps);
+
+        /* A job with a given size is written straight to the printer as
+         * it is generated; the spooler does its own sending.
+         */
+        bool abort_pjl = false;
+        file_pjl = NULL;
+        if (lpd_stream_size > 0 && spool_out_fd < 0) {
+            file_pjl = lpd_stream_open(host, lpd_stream_size, &abort_pjl);
+            if (!file_pjl) {
+                perror("Could not send pjl file to printer.\n");
+                return 1;
+            }
+            job.sink = file_pjl;
+        }
+
+        /* A streamed page reaches the cache through the tee. */
+        cache_page_begin(&cache);
+        job.tee = cache.file;
+
+        /* Execute the generation of the printer job language (pjl). */
+        if (!generate_pjl(file_bitmap, &job, filename_vector, file_vector)) {
+            perror("Generation of pjl file failed.\n");
+            abort_pjl = true;
+            if (file_pjl)
+                fclose(file_pjl);
+            pjl_free(&job);
+            return 1;
+        }
+        cache_page_end(&cache, &job);
+
+        /* A streamed page is followed by the next one until gs exits.
+         * The records read so far may have ended at the end of the file.
+         */
+        if (raster_stream && raster_stream_next(file_bitmap)) {
+            clearerr(file_vector);
+            pages++;
+        }
+
+        if (file_pjl) {
+            pjl_free(&job);
+            if (fclose(file_pjl)) {
+                return 1;
+            }
+            if (pages > 1) {
+                printf("Page %d of %d sent\n", page + 1, pages);
+            }
+            continue;
+        }
+
+        if (spool_out_fd >= 0) {
+            const bool spooled = spool_write_page(host, &job);
+            pjl_free(&job);
+            if (!spooled) {
+                perror("Could not spool pjl file.\n");
+                return 1;
+            }
+            continue;
+        }
+
+        if (pages > 1) {
+            printf("Page %d of %d generated\n", page + 1, pages);
+        }
+
+        /* Send print job to printer. */
+        if (sending && !page_send_finish(&sender)) {
+            perror("Could not send pjl file to printer.\n");
+            return 1;
         }
-        if (unlink(filename_vector)) {
-            perror(filename_vector);
+        sending = page_send_start(&sender, &job, suffix_page);
+        if (!sending) {
+            perror("Could not send pjl file to printer.\n");
+            return 1;
         }
     }
 
-    /* Open printer job language file. */
-    file_pjl = fopen(filename_pjl, "r");
-    if (!file_pjl) {
-        perror(filename_pjl);
+    /* Close open file handles; a streaming gs has to exit cleanly. */
+    if (raster_stream && !execute_ghostscript_finish(file_bitmap)) {
+        fprintf(stderr, "Failure to execute ghostscript command.\n");
         return 1;
     }
-    /* Send print job to printer. */
-    if (!printer_send(host, file_pjl)) {
+    if (!raster_stream && file_bitmap)
+        fclose(file_bitmap);
+    if (file_vector)
+        fclose(file_vector);
+
+    /* Cleanup unneeded files; debug mode keeps them. */
+    if (!raster_stream && raster_enabled) {
+        tmp_file_remove(filename_bitmap, file_basename, ".bmp");
+    }
+    tmp_file_remove(filename_eps, file_basename, ".eps");
+    if (pdf_input == filename_pdf) {
+        tmp_file_remove(filename_pdf, file_basename, ".pdf");
+    }
+    tmp_file_remove(filename_vector, file_basename, ".vector");
+
+    if (sending && !page_send_finish(&sender)) {
         perror("Could not send pjl file to printer.\n");
         return 1;
     }
-    fclose(file_pjl);
-    if (!debug) {
-        if (unlink(filename_pjl)) {
-            perror(filename_pjl);
-        }
-    }
 
+    cache_store_finish(&cache);
     return 0;
 }
+
+
+int
+main(int argc, char *argv[])
+{
+	return epilog_main(argc, argv);
+}
@@ -0,0 +1,70 @@
+/** \file
+ * Rough machine time model shared by epilog and pjl-sim.
+ *
+ * The head speeds at 100% and the raster overscan are nominal figures,
+ * not measured on a laser, so the times are only good for comparing
+ * one job with another.  A speed setting is a percentage of these.
+ */
+/*
+ * Copyright 2011 Trammell Hudson <hudson@osresearch.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *========================================================================
+ */
+#ifndef _laser_time_h_
+#define _laser_time_h_
+
+/** Head speeds at 100% and the overscan at each end of a raster sweep
+ * (in inches per second and inches).
+ */
+#define RASTER_SPEED_IPS (80.0)
+#define RASTER_OVERSCAN_IN (0.5)
+#define VECTOR_SPEED_IPS (10.0)
+#define TRANSIT_SPEED_IPS (40.0)
+
+
+/** Time for one raster row of pixels, a sweep of the head past its ends. */
+static inline double
+laser_row_time(
+	const int pixels,
+	const int resolution,
+	const int speed
+)
+{
+	return ((double) pixels / resolution + 2 * RASTER_OVERSCAN_IN)
+		/ (RASTER_SPEED_IPS * (speed ? speed : 1) / 100);
+}
+
+
+/** Time to cut a length in inches at a vector speed setting. */
+static inline double
+laser_cut_time(
+	const double len,
+	const int speed
+)
+{
+	return len / (VECTOR_SPEED_IPS * (speed ? speed : 1) / 100);
+}
+
+
+/** Time to move the head a length in inches with the laser off. */
+static inline double
+laser_transit_time(
+	const double len
+)
+{
+	return len / TRANSIT_SPEED_IPS;
+}
+
+#endif
@@ -0,0 +1,518 @@
+/** \file
+ * Local LPD printer emulator.
+ *
+ * Speaks the part of the LPD protocol (RFC 1179) that epilog and
+ * live-laser use, so that printer_connect() and printer_send() can be
+ * exercised and benchmarked without a laser:
+ *
+ * \002queue\n		-- receive a job; acked with a 0 byte
+ * \002count cfAname\n	-- control file of count bytes and a nul
+ * \003count dfAname\n	-- data file of count bytes
+ *
+ * Each job is stored as job-N.cf and job-N.pjl in the spool directory
+ * and a line with its timing is printed on stdout.  Latency before each
+ * ack, a bandwidth limit and a NAK for one of the steps can be injected.
+ *
+ * To run it without root, listen on another port with -p and point
+ * epilog at it with -p host:port.
+ */
+/*
+ * Copyright 2011 Trammell Hudson <hudson@osresearch.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *========================================================================
+ */
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signal.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+
+
+/** The steps of a job, for injecting a NAK. */
+enum {
+	STEP_QUEUE = 1,	// \002queue
+	STEP_CONTROL,	// \002count cfA
+	STEP_CONTROL_DATA, // the control file itself
+	STEP_DATA,	// \003count dfA
+	STEP_DATA_END,	// after the data file
+};
+
+/** Directory the jobs are stored in. */
+static const char * spool_dir = ".";
+
+/** Delay before each ack, in ms. */
+static int latency_ms = 0;
+
+/** Bytes per second to read the data file at, 0 for no limit. */
+static long bandwidth = 0;
+
+/** Step to NAK and the code to NAK it with, 0 for none. */
+static int nak_step = 0;
+static int nak_code = 1;
+
+/** Only NAK every nth connection. */
+static int nak_every = 1;
+
+/** Exit after this many complete jobs, 0 to run forever. */
+static int max_jobs = 0;
+
+/** Connections and stored jobs so far, and the connections still being
+ * served.  Once enough jobs are complete the listening socket is shut
+ * down and main waits for the rest of the connections to finish.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle = PTHREAD_COND_INITIALIZER;
+static int connections;
+static int jobs;
+static int completed;
+static int active;
+static bool finished;
+static int listen_fd = -1;
+
+
+/** A connection from a client. */
+typedef struct
+{
+	int fd;
+	int id;
+	char peer[NI_MAXHOST];
+	struct timespec start;
+} conn_t;
+
+
+static double
+elapsed(
+	const struct timespec * const start
+)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec - start->tv_sec
+		+ (now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+
+static void
+sleep_ms(
+	const double ms
+)
+{
+	if (ms <= 0)
+		return;
+
+	const struct timespec t = {
+		.tv_sec = ms / 1000,
+		.tv_nsec = ((long) (ms * 1e6)) % 1000000000,
+	};
+	nanosleep(&t, NULL);
+}
+
+
+/** Acknowledge a step, or NAK it if that was asked for. */
+static bool
+ack(
+	conn_t * const conn,
+	const int step
+)
+{
+	sleep_ms(latency_ms);
+
+	uint8_t code = 0;
+	if (step == nak_step && conn->id % nak_every == 0)
+		code = nak_code;
+
+	if (write(conn->fd, &code, 1) != 1)
+		return false;
+	if (code)
+		fprintf(stderr, "conn %d: nak %d at step %d\n",
+			conn->id, code, step);
+	return code == 0;
+}
+
+
+/** Read a command line, up to and including the newline. */
+static int
+read_line(
+	const int fd,
+	char * const buf,
+	const size_t size
+)
+{
+	size_t len = 0;
+
+	while (len < size - 1) {
+		const ssize_t rc = read(fd, &buf[len], 1);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			break;
+		if (buf[len++] == '\n')
+			break;
+	}
+
+	buf[len] = '\0';
+	return len;
+}
+
+
+/**
+ * Read len bytes into a file, holding to the bandwidth limit.
+ *
+ * @return The number of bytes read before the client stopped sending.
+ */
+static size_t
+read_file(
+	const int fd,
+	FILE * const out,
+	const size_t len
+)
+{
+	struct timespec start;
+	char buf[65536];
+	size_t got = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (got < len) {
+		size_t want = len - got;
+		if (want > sizeof(buf))
+			want = sizeof(buf);
+		if (bandwidth && want > (size_t) bandwidth / 10 + 1)
+			want = bandwidth / 10 + 1;
+
+		const ssize_t rc = read(fd, buf, want);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			break;
+
+		if (out)
+			fwrite(buf, 1, rc, out);
+		got += rc;
+
+		if (bandwidth)
+			sleep_ms(1000.0 * got / bandwidth
+				- 1000.0 * elapsed(&start));
+	}
+
+	return got;
+}
+
+
+/** Wait briefly for the nul that ends a file in RFC 1179. */
+static void
+read_trailing_nul(
+	const int fd
+)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	char c;
+
+	if (poll(&pfd, 1, 200) == 1)
+		if (recv(fd, &c, 1, MSG_PEEK) == 1 && c == '\0')
+			read(fd, &c, 1);
+}
+
+
+static FILE *
+job_file(
+	const int job,
+	const char * const suffix
+)
+{
+	char filename[1024];
+	snprintf(filename, sizeof(filename), "%s/job-%d%s",
+		spool_dir, job, suffix);
+
+	FILE * const file = fopen(filename, "w");
+	if (!file)
+		perror(filename);
+	return file;
+}
+
+
+static void *
+conn_thread(
+	void * const arg
+)
+{
+	conn_t * const conn = arg;
+	char line[1024];
+	char name[1024] = "";
+	size_t control_len = 0;
+	size_t data_len = 0;
+	size_t data_got = 0;
+	double handshake = 0;
+	double transfer = 0;
+	int job = 0;
+	bool complete = false;
+
+	/* Receive a job */
+	if (read_line(conn->fd, line, sizeof(line)) <= 0 || line[0] != '\002') {
+		fprintf(stderr, "conn %d: not a receive job command\n", conn->id);
+		goto done;
+	}
+	if (!ack(conn, STEP_QUEUE))
+		goto done;
+
+	pthread_mutex_lock(&lock);
+	job = ++jobs;
+	pthread_mutex_unlock(&lock);
+
+	/* Subcommands until the client is done */
+	while (read_line(conn->fd, line, sizeof(line)) > 0) {
+		size_t len;
+
+		if (line[0] == '\001') {
+			fprintf(stderr, "conn %d: job aborted\n", conn->id);
+			break;
+		}
+
+		if (sscanf(line + 1, "%zu %1023s", &len, name) != 2
+		|| (line[0] != '\002' && line[0] != '\003')) {
+			fprintf(stderr, "conn %d: bad subcommand\n", conn->id);
+			break;
+		}
+
+		if (line[0] == '\002') {
+			/* Control file */
+			if (!ack(conn, STEP_CONTROL))
+				break;
+
+			FILE * const cf = job_file(job, ".cf");
+			control_len = read_file(conn->fd, cf, len);
+			if (cf)
+				fclose(cf);
+			read_trailing_nul(conn->fd);
+
+			if (control_len != len || !ack(conn, STEP_CONTROL_DATA))
+				break;
+			continue;
+		}
+
+		/* Data file; the handshake ends when it starts */
+		handshake = elapsed(&conn->start);
+		data_len = len;
+		if (!ack(conn, STEP_DATA))
+			break;
+
+		FILE * const df = job_file(job, ".pjl");
+		data_got = read_file(conn->fd, df, len);
+		if (df)
+			fclose(df);
+		transfer = elapsed(&conn->start) - handshake;
+
+		read_trailing_nul(conn->fd);
+		if (data_got == len)
+			complete = ack(conn, STEP_DATA_END);
+		break;
+	}
+
+	printf("job %d from %s: %s control %zu data %zu/%zu bytes"
+		" handshake %.3f s transfer %.3f s %.0f bytes/s%s\n",
+		job,
+		conn->peer,
+		name,
+		control_len,
+		data_got,
+		data_len,
+		handshake,
+		transfer,
+		transfer > 0 ? data_got / transfer : 0,
+		data_got == data_len && data_len ? "" : " incomplete");
+	fflush(stdout);
+
+done:
+	close(conn->fd);
+	free(conn);
+
+	/* Only a job that was stored and acked counts towards the limit. */
+	pthread_mutex_lock(&lock);
+	if (complete)
+		completed++;
+	if (max_jobs && completed >= max_jobs && !finished) {
+		finished = true;
+		shutdown(listen_fd, SHUT_RD);
+	}
+	if (--active == 0)
+		pthread_cond_broadcast(&idle);
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+
+static void usage(int rc, const char * const msg)
+{
+	static const char usage_str[] =
+"Usage: lpd-emulator [options]\n"
+"Options:\n"
+" -a | --address ip                  Address to listen on (default 127.0.0.1)\n"
+" -p | --port N                      Port to listen on (default 515)\n"
+" -d | --dir path                    Directory to store the jobs in\n"
+" -l | --latency ms                  Delay before each ack\n"
+" -b | --bandwidth bytes/s           Limit the rate the job is read at\n"
+" -N | --nak step[:code]             NAK a step (1 queue, 2 control, 3 control\n"
+"                                    file, 4 data, 5 after the data)\n"
+" -e | --nak-every N                 Only NAK every Nth connection\n"
+" -c | --count N                     Exit after N complete jobs\n"
+"";
+	fprintf(stderr, "%s%s\n", msg, usage_str);
+	exit(rc);
+}
+
+
+static const struct option long_options[] = {
+	{ "address",		required_argument, NULL, 'a' },
+	{ "port",		required_argument, NULL, 'p' },
+	{ "dir",		required_argument, NULL, 'd' },
+	{ "latency",		required_argument, NULL, 'l' },
+	{ "bandwidth",		required_argument, NULL, 'b' },
+	{ "nak",		required_argument, NULL, 'N' },
+	{ "nak-every",		required_argument, NULL, 'e' },
+	{ "count",		required_argument, NULL, 'c' },
+	{ NULL,			0, NULL, 0 },
+};
+
+
+int
+main(int argc, char *argv[])
+{
+	const char * address = "127.0.0.1";
+	const char * port = "printer";
+
+	while (1)
+	{
+		const int ch = getopt_long(
+			argc,
+			argv,
+			"a:p:d:l:b:N:e:c:",
+			long_options,
+			NULL
+		);
+		if (ch <= 0)
+			break;
+
+		switch (ch)
+		{
+		case 'a': address = optarg; break;
+		case 'p': port = optarg; break;
+		case 'd': spool_dir = optarg; break;
+		case 'l': latency_ms = atoi(optarg); break;
+		case 'b': bandwidth = atol(optarg); break;
+		case 'N':
+			if (sscanf(optarg, "%d:%d", &nak_step, &nak_code) < 1
+			||  nak_step < STEP_QUEUE || nak_step > STEP_DATA_END
+			||  nak_code < 1 || nak_code > 255)
+				usage(EXIT_FAILURE, "nak must be step[:code]");
+			break;
+		case 'e': nak_every = atoi(optarg); break;
+		case 'c': max_jobs = atoi(optarg); break;
+		default: usage(EXIT_FAILURE, "Unknown argument\n"); break;
+		}
+	}
+
+	if (nak_every < 1)
+		nak_every = 1;
+
+	struct addrinfo hints = {
+		.ai_family = PF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE,
+	};
+	struct addrinfo * res;
+	const int error_code = getaddrinfo(address, port, &hints, &res);
+	if (error_code) {
+		fprintf(stderr, "%s:%s: %s\n", address, port,
+			gai_strerror(error_code));
+		return EXIT_FAILURE;
+	}
+
+	listen_fd = socket(res->ai_family, res->ai_socktype,
+		res->ai_protocol);
+	const int on = 1;
+	if (listen_fd < 0
+	||  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))
+	||  bind(listen_fd, res->ai_addr, res->ai_addrlen)
+	||  listen(listen_fd, 16)) {
+		perror(address);
+		return EXIT_FAILURE;
+	}
+	freeaddrinfo(res);
+
+	signal(SIGPIPE, SIG_IGN);
+	fprintf(stderr, "listening on %s:%s\n", address, port);
+
+	while (1) {
+		struct sockaddr_storage addr;
+		socklen_t addr_len = sizeof(addr);
+		const int fd = accept(listen_fd, (void *) &addr, &addr_len);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+
+			/* The socket is shut down once enough jobs are in */
+			pthread_mutex_lock(&lock);
+			const bool done = finished;
+			while (done && active)
+				pthread_cond_wait(&idle, &lock);
+			pthread_mutex_unlock(&lock);
+			if (done)
+				return EXIT_SUCCESS;
+
+			perror("accept");
+			return EXIT_FAILURE;
+		}
+
+		conn_t * const conn = calloc(1, sizeof(*conn));
+		pthread_t thread;
+		if (!conn) {
+			close(fd);
+			continue;
+		}
+		conn->fd = fd;
+		clock_gettime(CLOCK_MONOTONIC, &conn->start);
+		getnameinfo((void *) &addr, addr_len,
+			conn->peer, sizeof(conn->peer), NULL, 0, NI_NUMERICHOST);
+
+		pthread_mutex_lock(&lock);
+		conn->id = ++connections;
+		active++;
+		pthread_mutex_unlock(&lock);
+
+		if (pthread_create(&thread, NULL, conn_thread, conn) != 0) {
+			perror("thread");
+			close(fd);
+			free(conn);
+			pthread_mutex_lock(&lock);
+			active--;
+			pthread_mutex_unlock(&lock);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+}
@@ -0,0 +1,780 @@
+/** \file
+ * Decode and simulate a laser job.
+ *
+ * Reads a job as sent to the printer by epilog or ta10, decodes the PCL
+ * raster rows and the HPGL vectors, renders a preview and estimates the
+ * machine time, so that a change to the generator can be checked without
+ * burning material:
+ *
+ * \e*p#X \e*p#Y		-- raster position
+ * \e*b#A			-- row width, negative to raster right to left
+ * \e*b#M			-- row compression: 0 raw, 2 or 7 packbits, 3 delta
+ * \e*b#W			-- row data
+ * IN XR YP ZS PU PD		-- HPGL vectors, with y before x
+ * :7# U#,# D#,#		-- the TA10 vector dialect
+ *
+ * The time model is the rough one epilog uses for its estimate, from
+ * laser-time.h.  Its head speeds are nominal, not measured on a laser,
+ * so the times are for comparing jobs, not for planning a run.
+ */
+/*
+ * Copyright 2011 Trammell Hudson <hudson@osresearch.net>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *========================================================================
+ */
+#define _XOPEN_SOURCE 700
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "laser-time.h"
+
+
+/** Bed size in points, used if the job doesn't give its page size. */
+#define BED_HEIGHT (864)
+#define BED_WIDTH (1728)
+
+/** Accepted number of points per an inch. */
+#define POINTS_PER_INCH (72)
+
+/** Default resolution is 600 DPI */
+#define RESOLUTION_DEFAULT (600)
+
+/** Compression modes. */
+#define MODES (8)
+
+
+/** The state of the simulated printer. */
+typedef struct
+{
+	int resolution;
+	int raster_speed;
+	int raster_power;
+	int vector_speed;
+	int vector_power;
+	int vector_freq;
+	bool grey;
+
+	/* raster */
+	int mode;
+	int x;
+	int y;
+	int row_width;
+	uint8_t * row;
+	uint8_t * seed;
+	int seed_len;
+	int row_size;
+
+	/* page size in dots, once the job has given it */
+	int page_width;
+	int page_height;
+
+	/* preview, each pixel covering scale by scale dots */
+	uint8_t * preview;
+	int preview_width;
+	int preview_height;
+	int scale;
+
+	/* vectors */
+	int pen_x;
+	int pen_y;
+
+	/* what was seen */
+	int jobs;
+	long rows[MODES];
+	long row_bytes[MODES];
+	long raster_pixels;
+	double raster_time;
+	double cut_len;
+	double cut_time;
+	double transit_len;
+	double transit_time;
+	long errors;
+
+	/* start of the job, for the offsets in errors */
+	const uint8_t * job;
+} sim_t;
+
+
+static void
+sim_error(
+	sim_t * const sim,
+	const uint8_t * const p,
+	const char * const msg
+)
+{
+	if (sim->errors++ < 20)
+		fprintf(stderr, "%td: %s\n", p - sim->job, msg);
+}
+
+
+/** The preview is allocated at the first mark, once the page size is
+ * likely to be known.
+ */
+static bool
+preview_alloc(
+	sim_t * const sim
+)
+{
+	if (sim->preview || !sim->scale)
+		return sim->preview != NULL;
+
+	int w = sim->page_width;
+	int h = sim->page_height;
+	if (w <= 0 || h <= 0) {
+		w = BED_WIDTH * sim->resolution / POINTS_PER_INCH;
+		h = BED_HEIGHT * sim->resolution / POINTS_PER_INCH;
+	}
+
+	sim->preview_width = (w + sim->scale - 1) / sim->scale;
+	sim->preview_height = (h + sim->scale - 1) / sim->scale;
+	sim->preview = malloc((size_t) sim->preview_width * sim->preview_height);
+	if (!sim->preview) {
+		perror("preview");
+		sim->scale = 0;
+		return false;
+	}
+
+	memset(sim->preview, 255, (size_t) sim->preview_width * sim->preview_height);
+	return true;
+}
+
+
+/** Mark a dot, keeping the darkest mark in each preview pixel. */
+static inline void
+preview_mark(
+	sim_t * const sim,
+	const int x,
+	const int y,
+	const uint8_t power
+)
+{
+	const int px = x / sim->scale;
+	const int py = y / sim->scale;
+	if (x < 0 || y < 0 || px >= sim->preview_width || py >= sim->preview_height)
+		return;
+
+	uint8_t * const p = &sim->preview[(size_t) py * sim->preview_width + px];
+	if (255 - power < *p)
+		*p = 255 - power;
+}
+
+
+static void
+preview_line(
+	sim_t * const sim,
+	int x0,
+	int y0,
+	const int x1,
+	const int y1
+)
+{
+	if (!preview_alloc(sim))
+		return;
+
+	/* Step a preview pixel at a time */
+	const int dx = abs(x1 - x0);
+	const int dy = abs(y1 - y0);
+	const int steps = (dx > dy ? dx : dy) / sim->scale + 1;
+
+	for (int i = 0 ; i <= steps ; i++)
+		preview_mark(sim,
+			x0 + (long) (x1 - x0) * i / steps,
+			y0 + (long) (y1 - y0) * i / steps,
+			255);
+}
+
+
+/** Undo packbits; 128 is a no-op used for padding.
+ * @return The number of bytes decoded, or -1 if it overflows the row.
+ */
+static int
+unpackbits(
+	uint8_t * const out,
+	const int size,
+	const uint8_t * in,
+	const uint8_t * const end
+)
+{
+	int n = 0;
+
+	while (in < end) {
+		const int c = (int8_t) *in++;
+		if (c == -128)
+			continue;
+
+		if (c >= 0) {
+			const int len = c + 1;
+			if (n + len > size || in + len > end)
+				return -1;
+			memcpy(out + n, in, len);
+			in += len;
+			n += len;
+		} else {
+			const int len = 1 - c;
+			if (n + len > size || in >= end)
+				return -1;
+			memset(out + n, *in++, len);
+			n += len;
+		}
+	}
+
+	return n;
+}
+
+
+/** Undo a delta row against the seed, which out already holds.
+ * @return The number of bytes of the row, or -1 if it overflows.
+ */
+static int
+undelta(
+	uint8_t * const out,
+	const int size,
+	const uint8_t * in,
+	const uint8_t * const end
+)
+{
+	int pos = 0;
+
+	while (in < end) {
+		const int len = (*in >> 5) + 1;
+		int offset = *in++ & 31;
+		if (offset == 31) {
+			do {
+				if (in >= end)
+					return -1;
+				offset += *in;
+			} while (*in++ == 255);
+		}
+
+		pos += offset;
+		for (int i = 0 ; i < len && in < end ; i++) {
+			/* The padding may replace bytes past the end */
+			if (pos < size)
+				out[pos] = *in;
+			pos++;
+			in++;
+		}
+	}
+
+	return size;
+}
+
+
+/** Decode and draw one raster row. */
+static void
+raster_row(
+	sim_t * const sim,
+	const uint8_t * const data,
+	const int len
+)
+{
+	const int width = abs(sim->row_width);
+	if (width == 0)
+		return;
+
+	if (width > sim->row_size) {
+		sim->row = realloc(sim->row, width);
+		sim->seed = realloc(sim->seed, width);
+		if (!sim->row || !sim->seed) {
+			perror("row");
+			exit(EXIT_FAILURE);
+		}
+		sim->row_size = width;
+	}
+
+	int n;
+	switch (sim->mode) {
+	case 0:
+		n = len < width ? len : width;
+		memcpy(sim->row, data, n);
+		if (len < width)
+			n = -1;
+		break;
+	case 2:
+	case 7:
+		n = unpackbits(sim->row, width, data, data + len);
+		break;
+	case 3:
+		if (sim->seed_len == width)
+			memcpy(sim->row, sim->seed, width);
+		else
+			memset(sim->row, 0, width);
+		n = undelta(sim->row, width, data, data + len);
+		break;
+	default:
+		sim_error(sim, data, "unknown compression mode");
+		return;
+	}
+
+	if (n != width) {
+		sim_error(sim, data, "row does not decode to its width");
+		if (n < 0)
+			n = 0;
+		memset(sim->row + n, 0, width - n);
+	}
+
+	sim->rows[sim->mode]++;
+	sim->row_bytes[sim->mode] += len;
+
+	/* The seed is the row as it was sent */
+	memcpy(sim->seed, sim->row, width);
+	sim->seed_len = width;
+
+	const int pixels = sim->grey ? width : width * 8;
+	sim->raster_pixels += pixels;
+	sim->raster_time += laser_row_time(pixels, sim->resolution,
+		sim->raster_speed);
+
+	if (!preview_alloc(sim))
+		return;
+
+	for (int i = 0 ; i < width ; i++) {
+		/* Rows rastered right to left are sent reversed */
+		const uint8_t b = sim->row[sim->row_width < 0 ? width - 1 - i : i];
+		if (!b)
+			continue;
+
+		if (sim->grey) {
+			/* Grey levels are percent power */
+			preview_mark(sim, sim->x + i, sim->y,
+				b >= 100 ? 255 : b * 255 / 100);
+			continue;
+		}
+
+		for (int bit = 0 ; bit < 8 ; bit++)
+			if (b & (0x80 >> bit))
+				preview_mark(sim, sim->x + i * 8 + bit, sim->y, 255);
+	}
+}
+
+
+/** Move the head to a point, cutting or not. */
+static void
+vector_to(
+	sim_t * const sim,
+	const int x,
+	const int y,
+	const bool cut
+)
+{
+	const double len = hypot(x - sim->pen_x, y - sim->pen_y)
+		/ sim->resolution;
+
+	if (cut) {
+		sim->cut_len += len;
+		sim->cut_time += laser_cut_time(len, sim->vector_speed);
+		preview_line(sim, sim->pen_x, sim->pen_y, x, y);
+	} else {
+		sim->transit_len += len;
+		sim->transit_time += laser_transit_time(len);
+	}
+
+	sim->pen_x = x;
+	sim->pen_y = y;
+}
+
+
+static const uint8_t *
+parse_int(
+	const uint8_t * p,
+	const uint8_t * const end,
+	int * const value,
+	bool * const found
+)
+{
+	int sign = 1;
+	int v = 0;
+	*found = false;
+
+	if (p < end && (*p == '-' || *p == '+'))
+		sign = *p++ == '-' ? -1 : 1;
+	while (p < end && *p >= '0' && *p <= '9') {
+		v = v * 10 + *p++ - '0';
+		*found = true;
+	}
+	/* Fractions are not used by these jobs */
+	if (p < end && *p == '.')
+		for (p++ ; p < end && *p >= '0' && *p <= '9' ; p++)
+			;
+
+	*value = sign * v;
+	return p;
+}
+
+
+/**
+ * Parse the HPGL commands up to the next escape.  The coordinates are
+ * pairs with y first, as output_vector() writes them.
+ */
+static const uint8_t *
+hpgl(
+	sim_t * const sim,
+	const uint8_t * p,
+	const uint8_t * const end
+)
+{
+	while (p < end && *p != '\e') {
+		if (*p < 'A' || *p > 'Z' || p + 1 >= end) {
+			p++;
+			continue;
+		}
+
+		const char cmd[3] = { p[0], p[1], 0 };
+		p += 2;
+
+		int values[2];
+		int n = 0;
+		while (p < end) {
+			bool found;
+			int v;
+			p = parse_int(p, end, &v, &found);
+			if (!found)
+				break;
+			values[n++] = v;
+
+			if (n == 2) {
+				if (strcmp(cmd, "PU") == 0 || strcmp(cmd, "PD") == 0)
+					vector_to(sim, values[1], values[0], cmd[1] == 'D');
+				n = 0;
+			}
+
+			if (p < end && *p == ',')
+				p++;
+		}
+
+		if (strcmp(cmd, "YP") == 0 && n)
+			sim->vector_power = values[0];
+		else
+		if (strcmp(cmd, "ZS") == 0 && n)
+			sim->vector_speed = values[0];
+		else
+		if (strcmp(cmd, "XR") == 0 && n)
+			sim->vector_freq = values[0];
+	}
+
+	return p;
+}
+
+
+/** Parse a line of the TA10 dialect, with x before y. */
+static const uint8_t *
+ta10(
+	sim_t * const sim,
+	const uint8_t * p,
+	const uint8_t * const end
+)
+{
+	const uint8_t cmd = *p++;
+	int x;
+	int y;
+	bool found;
+
+	if (cmd == ':') {
+		/* :7 is the move speed, 1 to 50 */
+		if (p < end && *p == '7') {
+			p = parse_int(p + 1, end, &x, &found);
+			if (found)
+				sim->vector_speed = x * 2;
+		}
+	} else {
+		p = parse_int(p, end, &x, &found);
+		if (found && p < end && *p == ',') {
+			p = parse_int(p + 1, end, &y, &found);
+			if (found)
+				vector_to(sim, x, y, cmd == 'D');
+		}
+	}
+
+	while (p < end && *p != '\n')
+		p++;
+	return p;
+}
+
+
+/** Run a PCL escape sequence, which may combine several commands. */
+static const uint8_t *
+pcl(
+	sim_t * const sim,
+	const uint8_t * const start,
+	const uint8_t * const end,
+	bool * const in_hpgl
+)
+{
+	const uint8_t * p = start + 1;
+	if (p >= end)
+		return end;
+
+	if (*p == 'E')
+		return p + 1;
+
+	const uint8_t param = *p++;
+	if (param < '!' || param > '/')
+		return p;
+
+	uint8_t group = 0;
+	if (p < end && *p >= '`' && *p <= '~')
+		group = *p++;
+
+	while (p < end) {
+		int value;
+		bool found;
+		p = parse_int(p, end, &value, &found);
+		if (p >= end)
+			break;
+
+		const uint8_t term = *p++;
+		const uint8_t cmd = term & ~0x20;
+
+		if (param == '%' && cmd == 'X') {
+			/* Universal exit; PJL lines follow */
+			*in_hpgl = false;
+		} else
+		if (param == '%' && cmd == 'B') {
+			*in_hpgl = value >= 0 && value != 0;
+		} else
+		if (param == '&' && group == 'u' && cmd == 'D') {
+			sim->resolution = value;
+		} else
+		if (param == '*' && group == 't' && cmd == 'R') {
+			sim->resolution = value;
+		} else
+		if (param == '&' && group == 'y' && cmd == 'P') {
+			sim->raster_power = value;
+		} else
+		if (param == '&' && group == 'z' && cmd == 'S') {
+			sim->raster_speed = value;
+		} else
+		if (param == '*' && group == 'r' && cmd == 'S') {
+			sim->page_width = value;
+		} else
+		if (param == '*' && group == 'r' && cmd == 'T') {
+			sim->page_height = value;
+		} else
+		if (param == '*' && group == 'p' && cmd == 'X') {
+			sim->x = value;
+		} else
+		if (param == '*' && group == 'p' && cmd == 'Y') {
+			sim->y = value;
+		} else
+		if (param == '*' && group == 'b' && cmd == 'M') {
+			sim->mode = value;
+			if (value == 7)
+				sim->grey = true;
+			if (value < 0 || value >= MODES) {
+				sim_error(sim, start, "bad mode");
+				sim->mode = 2;
+			}
+		} else
+		if (param == '*' && group == 'b' && cmd == 'A') {
+			sim->row_width = value;
+		} else
+		if (param == '*' && group == 'b' && cmd == 'W') {
+			if (value < 0 || p + value > end) {
+				sim_error(sim, start, "row data past the end of the job");
+				return end;
+			}
+			raster_row(sim, p, value);
+			p += value;
+		}
+
+		/* Upper case ends the sequence, lower case combines another */
+		if (term >= '@' && term <= '^')
+			break;
+	}
+
+	return p;
+}
+
+
+static void
+simulate(
+	sim_t * const sim,
+	const uint8_t * p,
+	const uint8_t * const end
+)
+{
+	bool in_hpgl = false;
+	bool line_start = true;
+
+	while (p < end) {
+		if (*p == '\e') {
+			p = pcl(sim, p, end, &in_hpgl);
+			line_start = false;
+			continue;
+		}
+
+		if (in_hpgl) {
+			p = hpgl(sim, p, end);
+			continue;
+		}
+
+		if (*p == '@') {
+			/* A PJL command line */
+			if (end - p > 8 && memcmp(p, "@PJL JOB", 8) == 0)
+				sim->jobs++;
+			while (p < end && *p != '\n')
+				p++;
+			continue;
+		}
+
+		if (line_start && (*p == ':' || *p == 'U' || *p == 'D')) {
+			p = ta10(sim, p, end);
+			continue;
+		}
+
+		line_start = *p == '\n' || *p == '\r';
+		p++;
+	}
+}
+
+
+static bool
+write_preview(
+	const sim_t * const sim,
+	const char * const filename
+)
+{
+	FILE * const out = fopen(filename, "w");
+	if (!out) {
+		perror(filename);
+		return false;
+	}
+
+	fprintf(out, "P5\n%d %d\n255\n", sim->preview_width, sim->preview_height);
+	fwrite(sim->preview, 1, (size_t) sim->preview_width * sim->preview_height, out);
+	return fclose(out) == 0;
+}
+
+
+static void
+report(
+	const sim_t * const sim
+)
+{
+	printf("Jobs: %d resolution %d%s\n",
+		sim->jobs, sim->resolution, sim->grey ? " grey" : "");
+
+	for (int i = 0 ; i < MODES ; i++)
+		if (sim->rows[i])
+			printf("Raster mode %d: %ld rows %ld bytes\n",
+				i, sim->rows[i], sim->row_bytes[i]);
+
+	printf("Raster: %ld pixels speed %d power %d time %.1f s\n",
+		sim->raster_pixels,
+		sim->raster_speed,
+		sim->raster_power,
+		sim->raster_time);
+	printf("Cut: %.2f in time %.1f s\n", sim->cut_len, sim->cut_time);
+	printf("Transit: %.2f in time %.1f s\n", sim->transit_len, sim->transit_time);
+	printf("Total: %.1f s\n",
+		sim->raster_time + sim->cut_time + sim->transit_time);
+	if (sim->errors)
+		printf("Errors: %ld\n", sim->errors);
+}
+
+
+static void usage(int rc, const char * const msg)
+{
+	static const char usage_str[] =
+"Usage: pjl-sim [options] job.pjl\n"
+"Options:\n"
+" -o | --preview file.pgm            Render the marks to a greyscale image\n"
+" -s | --scale N                     Dots per preview pixel (default 8)\n"
+" -d | --dpi N                       Resolution if the job doesn't set it\n"
+"";
+	fprintf(stderr, "%s%s\n", msg, usage_str);
+	exit(rc);
+}
+
+
+static const struct option long_options[] = {
+	{ "preview",		required_argument, NULL, 'o' },
+	{ "scale",		required_argument, NULL, 's' },
+	{ "dpi",		required_argument, NULL, 'd' },
+	{ NULL,			0, NULL, 0 },
+};
+
+
+int
+main(int argc, char *argv[])
+{
+	const char * preview = NULL;
+	sim_t sim = {
+		.resolution = RESOLUTION_DEFAULT,
+		.raster_speed = 100,
+		.vector_speed = 100,
+		.mode = 2,
+		.scale = 8,
+	};
+
+	while (1)
+	{
+		const int ch = getopt_long(argc, argv, "o:s:d:", long_options, NULL);
+		if (ch <= 0)
+			break;
+
+		switch (ch)
+		{
+		case 'o': preview = optarg; break;
+		case 's': sim.scale = atoi(optarg); break;
+		case 'd': sim.resolution = atoi(optarg); break;
+		default: usage(EXIT_FAILURE, "Unknown argument\n"); break;
+		}
+	}
+
+	if (argc - optind != 1)
+		usage(EXIT_FAILURE, "One job file must be specified\n");
+	if (sim.scale < 1 || sim.resolution < 1)
+		usage(EXIT_FAILURE, "Scale and dpi must be positive\n");
+	if (!preview)
+		sim.scale = 0;
+
+	const char * const filename = argv[optind];
+	const int fd = open(filename, O_RDONLY);
+	struct stat file_stat;
+	if (fd < 0 || fstat(fd, &file_stat) < 0) {
+		perror(filename);
+		return EXIT_FAILURE;
+	}
+
+	/* Map the job rather than read it; they can be hundreds of MB */
+	const size_t len = file_stat.st_size;
+	const uint8_t * const job = len
+		? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0)
+		: NULL;
+	if (len && job == MAP_FAILED) {
+		perror(filename);
+		return EXIT_FAILURE;
+	}
+	if (len)
+		posix_madvise((void *) job, len, POSIX_MADV_SEQUENTIAL);
+
+	sim.job = job;
+	simulate(&sim, job, job + len);
+	report(&sim);
+
+	if (preview && sim.preview && !write_preview(&sim, preview))
+		return EXIT_FAILURE;
+
+	return sim.errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}